@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>  // For TCP_NODELAY
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <pthread.h>
@@ -16,15 +17,159 @@
 #include <iomanip> // Added for setprecision
 #include <fstream> // For file logging
 #include <sstream> // For string stream operations
+#include <sys/epoll.h>    // For the server event loop
+#include <sys/resource.h> // For raising the open file limit
+#include <map>                // For the connection pool
+#include <deque>              // For queued server replies
+#include <sys/sendfile.h>     // For zero-copy DOWNLOAD replies
+#include <sys/inotify.h>      // For keeping the own-file index current
+#include <atomic>             // For the parallel download bitmaps
+#include <stdint.h>
+#include <algorithm>          // For std::min
+#include <poll.h>             // For scanning all peers at once
+#include <unordered_map>      // For the file catalog index
+#include <memory>             // For sharing catalog snapshots with readers
+#include <list>               // For the descriptor cache LRU order
+#include <sys/mman.h>         // For the memory-mapped serving mode
+#include <sys/uio.h>          // For vectored sends from mappings
+#include <sys/eventfd.h>      // For waking event loops when peers are queued
+#include <sys/un.h>           // For claiming our port in SO_REUSEPORT mode
+#include <stddef.h>           // For offsetof
+#include <set>                // For files waiting to be hashed
+#include <endian.h>           // For the little-endian binary wire format
 
 // Port configuration - easily changeable
 const int PORTS[] = {8080, 8081, 8082, 8083, 8084};
 const int MAX_PORTS = 5;
-const int MAX_FILES = 100;
+const int CATALOG_SHARDS = 16;  // independently locked slices of the file catalog
 const int MAX_FILENAME_LENGTH = 256;
 
+// Server configuration
+const int REACTOR_THREADS = 2;     // default number of event loop threads serving peer requests
+const size_t SERVER_THREAD_STACK_SIZE = 256 * 1024; // server threads keep nothing big on the stack
+const int MAX_EPOLL_EVENTS = 256;  // events handled per epoll_wait call
+const size_t SESSION_MAX_BACKLOG = 256 * 1024; // unsent response bytes before a session stops parsing
+const size_t SESSION_MAX_QUEUED_REPLIES = 64;  // replies (and open files) queued per session
+const size_t SENDFILE_MAX_CHUNK = 4 * 1024 * 1024; // bytes handed to one sendfile() call
+
+// Binary wire protocol. Every message is a fixed wire_header_t followed by
+// `length` payload bytes, all integers little-endian. A client opens with
+// WIRE_OP_HELLO offering a version range and feature bits; the seed answers
+// with the version and features it picked, and from then on the connection
+// carries only binary requests, each answered in order with the request's
+// id echoed back. Text commands (one-shot or SESSION) remain for older peers.
+const uint8_t WIRE_MAGIC = 0xB5;     // never the first byte of a text command
+const uint8_t WIRE_VERSION = 1;
+const uint32_t WIRE_FEATURE_LIST_DIGEST = 1; // LIST pages can carry content digests
+const uint32_t WIRE_FEATURES = WIRE_FEATURE_LIST_DIGEST;
+const size_t WIRE_MAX_REQUEST = 1024; // request payloads are a file name plus fixed fields
+
+typedef enum {
+    WIRE_OP_HELLO = 1,
+    WIRE_OP_FILESIZE = 2,   // payload: name; reply: uint64 size
+    WIRE_OP_DOWNLOAD = 3,   // payload: wire_download_t + name; reply: the bytes
+    WIRE_OP_LIST = 4,       // payload: wire_list_t + cursor name; reply: a LISTX page
+    WIRE_OP_STATS = 5       // no payload; reply: the metrics text STATS returns
+} wire_opcode_t;
+
+typedef enum {
+    WIRE_OK = 0,
+    WIRE_ERROR = 1,
+    WIRE_NOT_FOUND = 2,
+    WIRE_BAD_REQUEST = 3,
+    WIRE_UNSUPPORTED = 4
+} wire_status_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t status;        // wire_status_t in replies, 0 in requests
+    uint32_t request_id;   // chosen by the client, echoed in the reply
+    uint64_t length;       // payload bytes that follow
+} wire_header_t;
+
+// HELLO payload in both directions
+typedef struct __attribute__((packed)) {
+    uint8_t min_version;
+    uint8_t max_version;
+    uint16_t reserved;
+    uint32_t features;
+} wire_hello_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t offset;
+    uint64_t length;
+} wire_download_t;
+
+const uint32_t WIRE_LIST_DIGEST = 1;
+
+// LIST request; the last name of the previous page follows, raw, or
+// nothing for the first page
+typedef struct __attribute__((packed)) {
+    uint32_t flags;
+} wire_list_t;
+
 // Download configuration
-const int CHUNK_DELAY_MICROSECONDS = 5000; // 100ms delay between chunks
+const int SESSION_PIPELINE_DEPTH = 4;      // DOWNLOAD requests kept in flight per seed
+const int DOWNLOAD_CHUNK_SIZE = 64 * 1024; // bookkeeping unit; one DOWNLOAD asks for a run of chunks
+const int LIST_PAGE_ENTRIES = 512;        // files per LISTX page
+const double PIECE_TARGET_SECONDS = 0.05;   // a piece should take at least this long to transfer
+const double BANDWIDTH_BURST_SECONDS = 1.0; // unused budget that may be spent at once
+const double CHECKPOINT_INTERVAL_SECONDS = 1.0; // how often the resume sidecar is updated
+const double ENDGAME_TAIL_SHARE = 0.05;     // share of a file's chunks still outstanding when endgame starts
+const int ENDGAME_MAX_CHUNKS = 512;         // cap on that tail for very large files
+const double SCORE_EWMA_WEIGHT = 0.3;       // weight of the newest sample in a seed's score
+const double SCORE_REFERENCE_PIECE = 1024 * 1024; // piece size a seed's score is quoted for
+const int POOL_MAX_IDLE_PER_SEED = 8;      // warm sessions kept open per seed port
+const int SEED_IO_TIMEOUT_SECONDS = 10;    // a seed silent for this long is treated as gone
+
+// Piece size bounds, overridable with SEEDAPP_MIN_PIECE / SEEDAPP_MAX_PIECE /
+// SEEDAPP_INITIAL_PIECE (bytes) at startup
+long long download_min_piece_size = 64 * 1024;
+long long download_initial_piece_size = 1024 * 1024;
+long long download_max_piece_size = 16 * 1024 * 1024;
+
+// Seed server limits, overridable with SEEDAPP_SERVER_THREADS,
+// SEEDAPP_ACCEPT_QUEUE and SEEDAPP_MAX_CONNECTIONS. Peers beyond either
+// limit are told BUSY and disconnected instead of being left to time out.
+int server_threads = REACTOR_THREADS;
+size_t accept_queue_depth = 1024;  // accepted peers not yet picked up by an event loop
+long long max_connections = 4096;  // peers served at once
+const char BUSY_REPLY[] = "ERROR: BUSY\n";
+
+// Listening setup, overridable with SEEDAPP_ACCEPTORS and SEEDAPP_LISTEN_BACKLOG.
+// With more than one acceptor the seed opens that many SO_REUSEPORT sockets
+// on its port, each with its own acceptor and event loop pinned to a core,
+// and SEEDAPP_SERVER_THREADS is ignored.
+int acceptor_count = 1;
+int listen_backlog = SOMAXCONN;
+
+// Idle descriptors a seed keeps open for reuse, overridable with SEEDAPP_FD_CACHE
+size_t fd_cache_capacity = 256;
+
+// Memory-mapped serving, enabled with SEEDAPP_SERVE_MMAP=1. Idle mappings
+// are unmapped once more than SEEDAPP_MMAP_BUDGET bytes are mapped.
+bool serve_mmap = false;
+long long mmap_budget = 512LL * 1024 * 1024;
+
+// How long discovery waits for each peer to answer, overridable with
+// SEEDAPP_SCAN_TIMEOUT_MS
+long long scan_timeout_ms = 2000;
+
+// How long a catalog entry's seeds and size are trusted without asking
+// again, overridable with SEEDAPP_CATALOG_TTL (seconds, 0 = always ask)
+long long catalog_ttl_seconds = 60;
+
+// Ask seeds for content digests when listing, enabled with SEEDAPP_LIST_DIGEST=1.
+// Off by default since a seed has to read each file once to hash it.
+bool list_digests = false;
+bool wire_protocol = true;     // offer seeds the binary protocol for transfers
+
+// Download manager limits, overridable with SEEDAPP_MAX_DOWNLOADS and
+// SEEDAPP_BANDWIDTH_LIMIT (bytes per second across all downloads, 0 = unlimited)
+int max_concurrent_downloads = 3;
+long long bandwidth_limit = 0;
 
 //global variables
 typedef struct {
@@ -37,48 +182,562 @@ typedef struct {
     int thread_index;
 } port_thread_data_t;
 
+// One file in the catalog, with every seed that listed it
 typedef struct {
-    char filename[MAX_FILENAME_LENGTH];
-    int source_port;
-}file_info_t;
+    std::string filename;
+    std::vector<int> seeds;
+    long long size;    // -1 until a seed reports it
+    time_t mtime;      // 0 until a seed reports it
+    std::string digest; // content hash as hex, empty unless a seed sent one
+    int id;            // 1-based number shown in the menus
+    double refreshed_at; // monotonic time the seed list was last confirmed
+} catalog_entry_t;
+
+// A slice of the catalog's hash index with its own reader/writer lock
+typedef struct {
+    std::unordered_map<std::string, catalog_entry_t> files;
+    pthread_rwlock_t lock;
+} catalog_shard_t;
+
+// Files offered by the other peers. A listing builds a new catalog and
+// publishes it whole; readers take a reference to the published one and
+// never block a rebuild.
+typedef struct {
+    catalog_shard_t shards[CATALOG_SHARDS];
+    std::vector<std::string> order;  // filenames by id, in discovery order
+    pthread_mutex_t order_mutex;
+    int seeds_found;
+} catalog_t;
 
 port_thread_data_t port_threads[MAX_PORTS];
 int bound_port_count = 0;
-file_info_t unique_files[MAX_FILES];  // Use the structure instead of char array
-int unique_file_count = 0;
 int my_bound_port = -1; 
 
-pthread_mutex_t file_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::shared_ptr<catalog_t> file_catalog;  // latest published catalog, never NULL after startup
+pthread_mutex_t file_list_mutex = PTHREAD_MUTEX_INITIALIZER; // guards the file_catalog pointer only
+std::atomic<bool> catalog_refreshing(false); // a background rediscovery is running
+
+// An open descriptor for one of our files, shared by every reply that
+// streams from it. Replies read it positionally (sendfile with an explicit
+// offset), so concurrent ranges never disturb each other.
+typedef struct cached_fd_s {
+    std::string name;
+    int fd;
+    long long size;         // index metadata the descriptor was opened against
+    time_t mtime;
+    int refs;               // replies still streaming from it
+    bool stale;             // dropped from the cache; closed when refs reaches 0
+    std::list<struct cached_fd_s*>::iterator lru_position;
+    char* map;              // whole-file mapping in mmap mode, NULL otherwise
+    long long next_offset;  // where the last range ended, for madvise
+} cached_fd_t;
+
+// Seed-side LRU cache of open descriptors, keyed by file name
+typedef struct {
+    long long hits;
+    long long misses;
+    long long evictions;     // idle descriptors closed to stay within capacity
+    long long invalidations; // descriptors dropped because the file changed
+    long long mapped_bytes;  // currently mapped in mmap mode
+    long long unmaps;        // idle mappings released to stay within mmap_budget
+} fd_cache_stats_t;
+
+std::unordered_map<std::string, cached_fd_t*> fd_cache;
+std::list<cached_fd_t*> fd_cache_lru;  // most recently used first
+fd_cache_stats_t fd_cache_stats = {0, 0, 0, 0, 0, 0};
+pthread_mutex_t fd_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// One queued reply: bytes already in memory, optionally followed by a file
+// range that is streamed with sendfile() straight from the page cache
+typedef struct {
+    std::string data;
+    size_t data_sent;
+    cached_fd_t* file;      // NULL when the reply is memory only
+    off_t file_offset;
+    size_t file_remaining;
+    const char* mapped;     // file->map when the range is sent from memory
+} out_segment_t;
+
+// Requests the seed answers, for per-command metrics
+typedef enum {
+    SEED_CMD_SESSION,
+    SEED_CMD_LIST,
+    SEED_CMD_LISTX,
+    SEED_CMD_FILESIZE,
+    SEED_CMD_DOWNLOAD,
+    SEED_CMD_STATS,
+    SEED_CMD_UNKNOWN,
+    SEED_COMMANDS
+} seed_command_t;
+
+const char* SEED_COMMAND_NAMES[SEED_COMMANDS] = {"SESSION", "LIST", "LISTX", "FILESIZE", "DOWNLOAD", "STATS", "UNKNOWN"};
+
+// A reply still on its way out, timed for the latency histograms
+typedef struct {
+    seed_command_t command;
+    long long started_ns;   // request bytes arrived
+    long long queued_ns;    // reply fully queued
+    long long end;          // reply ends at this many bytes queued on the connection
+    long long read_ns;      // time spent in sendfile/sendmsg reading its file range
+} reply_timing_t;
+
+// Server connection state - each accepted peer is driven by one reactor
+typedef enum {
+    CONN_READING,  // waiting for the request to arrive
+    CONN_WRITING,  // flushing the response
+    CONN_CLOSED
+} conn_state_t;
+
+typedef struct {
+    int fd;
+    conn_state_t state;
+    bool session_mode;      // peer sent SESSION: many framed requests per connection
+    bool binary_mode;       // peer negotiated the binary wire protocol
+    uint32_t request_id;    // binary request being answered, echoed in its reply
+    uint8_t opcode;
+    bool peer_closed;
+    bool close_after_flush; // legacy one-shot request has been answered
+    char in_buffer[4096];
+    size_t in_length;
+    std::deque<out_segment_t> out_queue; // replies not fully sent yet, in request order
+    size_t out_pending_bytes;            // in-memory bytes still in out_queue
+    int responses_queued;
+    seed_command_t command;              // request being answered
+    long long received_ns;               // when the requests now in in_buffer started arriving
+    long long queued_total;              // reply bytes queued over the connection's life
+    long long sent_total;                // reply bytes handed to the socket
+    std::deque<reply_timing_t> timings;  // one per reply in out_queue
+} connection_t;
+
+
+// Bounded lock-free multi-producer/multi-consumer queue of accepted peer
+// sockets (Vyukov's array queue). A cell's sequence number says whose turn
+// it is: equal to the position when free for the producer that claims
+// that position, position + 1 once filled for the matching consumer.
+typedef struct {
+    std::atomic<size_t> sequence;
+    int fd;
+    long long queued_ns;    // when it was accepted, for the queue wait metric
+} fd_queue_cell_t;
+
+typedef struct {
+    fd_queue_cell_t* cells;
+    size_t mask;                                   // capacity - 1, capacity a power of two
+    alignas(64) std::atomic<size_t> enqueue_position;
+    alignas(64) std::atomic<size_t> dequeue_position;
+} fd_queue_t;
+
+// One listening socket and the thread accepting from it. Accepted peers
+// wait in `queue` until a reactor fed by this acceptor adopts them.
+typedef struct {
+    int index;
+    int listen_fd;
+    int cpu;                           // core it and its reactor run on, -1 if not pinned
+    fd_queue_t queue;
+    int event_fd;                      // bumped after queueing peers
+    std::atomic<long long> accepted;
+    std::atomic<long long> rejected;   // turned away with BUSY
+    pthread_t thread_id;
+} acceptor_t;
+
+typedef struct {
+    int index;
+    int epoll_fd;
+    acceptor_t* acceptor;              // where this reactor takes new peers from
+    pthread_t thread_id;
+} reactor_t;
+
+std::vector<acceptor_t*> acceptors;
+std::vector<reactor_t> reactors;
+std::atomic<long long> active_connections(0);  // peers being served now, across all reactors
+int port_claim_fd = -1;  // abstract unix socket marking our port as taken in SO_REUSEPORT mode
 
 // Logging system
+// Log levels. LOG_LEVEL is fixed at build time (make LOG_LEVEL=5 for a
+// build with per-piece tracing); statements above it are discarded by the
+// compiler, arguments and all. SEEDAPP_LOG_LEVEL can lower the level of a
+// running build further, and arguments below it are not evaluated either.
+#define LOG_ERROR 1
+#define LOG_WARN  2
+#define LOG_INFO  3
+#define LOG_DEBUG 4
+#define LOG_TRACE 5   // one line per piece or request
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+constexpr int compiled_log_level = LOG_LEVEL;
+int log_level = LOG_LEVEL;
+
+// LOG_CLIENT(LOG_INFO, "Port " << port << " is up") - the message is built
+// with stream operators, only once the level is known to be enabled
+#define LOG_CLIENT(level, message) LOG_TO(log_client, level, message)
+#define LOG_SERVER(level, message) LOG_TO(log_server, level, message)
+#define LOG_TO(sink, level, message) \
+    do { \
+        if constexpr ((level) <= compiled_log_level) { \
+            if ((level) <= log_level) { \
+                std::ostringstream log_stream; \
+                log_stream << message; \
+                sink(log_stream.str()); \
+            } \
+        } \
+    } while (0)
+
+// Metrics registry
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+    METRIC_SUMMARY      // latency histogram reported as quantiles
+} metric_kind_t;
+
+// Histogram bucket upper bounds in microseconds; one more bucket catches the rest
+const long long METRIC_BUCKET_BOUNDS[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+                                          100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+const int METRIC_BUCKETS = sizeof(METRIC_BUCKET_BOUNDS) / sizeof(METRIC_BUCKET_BOUNDS[0]) + 1;
+
+// HDR-style latency histogram over nanoseconds: each power of two is split
+// into LATENCY_SUB_BUCKETS linear buckets, so every value is kept to within
+// about 6% at any scale, and recording is one atomic increment.
+const int LATENCY_SUB_BITS = 4;
+const int LATENCY_SUB_BUCKETS = 1 << LATENCY_SUB_BITS;
+const int LATENCY_MAX_BITS = 40;    // about 18 minutes; longer values are clamped
+const int LATENCY_BUCKETS = LATENCY_SUB_BUCKETS * (LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1);
+const double LATENCY_QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+const int LATENCY_QUANTILE_COUNT = sizeof(LATENCY_QUANTILES) / sizeof(LATENCY_QUANTILES[0]);
+
+typedef struct {
+    std::atomic<long long> counts[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+// Stages of serving a request, timed separately
+typedef enum {
+    SEED_STAGE_QUEUE,   // accepted until a reactor adopts the connection
+    SEED_STAGE_OPEN,    // index lookup and descriptor cache (and mapping)
+    SEED_STAGE_READ,    // inside sendfile/sendmsg, where the file is read
+    SEED_STAGE_SEND,    // reply queued until its last byte is on the socket
+    SEED_STAGES
+} seed_stage_t;
+
+const char* SEED_STAGE_NAMES[SEED_STAGES] = {"queue", "open", "read", "send"};
+
+typedef struct {
+    std::string name;
+    std::string labels;                 // e.g. command="LIST", without braces
+    metric_kind_t kind;
+    std::atomic<long long> value;       // counter or gauge; sum of observations for histograms
+    std::atomic<long long> count;       // histogram observations
+    std::atomic<long long> buckets[METRIC_BUCKETS];
+    long long (*reader)();              // read the value from elsewhere instead
+    latency_histogram_t* latency;       // METRIC_SUMMARY only
+} metric_t;
+
+std::map<std::string, metric_t*> metric_registry; // by name and labels, so output is grouped by name
+pthread_mutex_t metric_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+metric_t* seed_request_metrics[SEED_COMMANDS];
+metric_t* seed_bytes_sent_metric;
+metric_t* client_bytes_received_metric;
+metric_t* client_piece_latency_metric;
+metric_t* seed_latency_metrics[SEED_COMMANDS];
+metric_t* seed_stage_metrics[SEED_STAGES];
+
+// Log files, owned by the log writer thread
 std::ofstream client_log_file;
 std::ofstream server_log_file;
-pthread_mutex_t client_log_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t server_log_mutex = PTHREAD_MUTEX_INITIALIZER;
 std::string client_log_filename;
 std::string server_log_filename;
-bool client_logging_active = false;
-bool server_logging_active = false;
 
-// Download thread data structure
+// Asynchronous logging. log_client/log_server copy the message into a ring
+// owned by the calling thread and return; a single writer thread drains
+// every ring, puts the records back in time order and writes them in
+// batches. Each ring has one producer and one consumer, so neither side
+// takes a lock. A message that doesn't fit the ring is dropped and counted.
+const int LOG_RING_RECORDS = 1024;     // per thread
+const size_t LOG_RECORD_TEXT = 232;    // longer messages span several records
+const int LOG_WRITER_IDLE_US = 5000;   // writer nap when every ring is empty
+
+typedef enum {
+    LOG_TO_CLIENT = 0,
+    LOG_TO_SERVER = 1,
+    LOG_TARGETS = 2
+} log_target_t;
+
+typedef enum {
+    LOG_MESSAGE,
+    LOG_CLOSE       // close the target's file once everything before is out
+} log_kind_t;
+
+typedef struct {
+    struct timespec when;
+    uint8_t target;
+    uint8_t kind;
+    uint8_t more;       // the message carries on in the next record
+    uint8_t reserved;
+    uint32_t length;    // text bytes in this record
+    char text[LOG_RECORD_TEXT];
+} log_record_t;
+
+typedef struct log_ring {
+    std::atomic<size_t> head;   // next slot the owning thread writes
+    std::atomic<size_t> tail;   // next slot the writer reads
+    std::atomic<bool> owned;    // a live thread is producing into it
+    std::atomic<long long> dropped[LOG_TARGETS];
+    struct log_ring* next;      // all rings ever made, never freed
+    log_record_t records[LOG_RING_RECORDS];
+} log_ring_t;
+
+std::atomic<log_ring_t*> log_rings(NULL);
+pthread_key_t log_ring_key;
+pthread_once_t log_writer_once = PTHREAD_ONCE_INIT;
+pthread_t log_writer_thread;
+std::atomic<bool> log_writer_running(false);
+std::atomic<bool> log_writer_stop(false);
+
+// Client end of a persistent session with one seed
+typedef struct {
+    int fd;
+    int port;
+    char buffer[4096]; // bytes received but not yet parsed
+    size_t start;
+    size_t end;
+    int pending_replies; // requests sent whose reply hasn't been read yet
+    bool reused;       // handed out from the pool rather than freshly connected
+    bool binary;       // negotiated the binary wire protocol instead of text
+    uint32_t features; // WIRE_FEATURE_* bits the seed agreed to
+    uint32_t next_request_id;
+    uint32_t next_reply_id; // replies come back in request order
+    bool busy;         // the seed turned us away with BUSY_REPLY
+} seed_session_t;
+
+// How a seed answered our binary hello
+typedef enum {
+    WIRE_NEGOTIATED,
+    WIRE_TEXT_ONLY,  // replied in text: it predates the wire protocol
+    WIRE_HUNG_UP,    // closed without a word, as pre-session seeds do
+    WIRE_FAILED      // busy, timed out or reset
+} wire_negotiation_t;
+
+typedef enum {
+    SEED_CALL_OK,
+    SEED_NOT_RUNNING,  // could not connect
+    SEED_NO_RESPONSE   // connected but the request failed
+} seed_call_result_t;
+
+// Reply from one peer during a discovery scan
+typedef struct {
+    int port;
+    seed_call_result_t result;
+    bool ok;
+    std::string payload;
+} scan_result_t;
+
+// One parsed line of a seed's listing
+typedef struct {
+    std::string filename;
+    long long size;     // -1 if the seed only sent a plain LIST
+    time_t mtime;
+    std::string digest; // empty unless the seed hashed the file
+} listing_entry_t;
+
+// Called with each answer while scanning; returns the next request to send
+// on the same session, or "" when that peer is done
+typedef std::string (*scan_reply_fn)(scan_result_t* result, void* arg);
+
+// Called for every file a listing scan turns up
+typedef void (*listing_entry_fn)(int port, listing_entry_t* entry, void* arg);
+
+typedef struct {
+    std::string command;   // "LISTX" or "LISTX DIGEST"; the cursor is appended
+    listing_entry_fn on_entry;
+    void* arg;
+} listing_scan_t;
+
+// Which seeds list one particular file, while scanning for it
+typedef struct {
+    std::string filename;
+    long long size;          // first size a seed reported, -1 until then
+    std::vector<int> ports;
+} file_search_t;
+
+typedef enum {
+    SCAN_CONNECTING,  // non-blocking connect in progress
+    SCAN_SENDING,     // writing the request
+    SCAN_READING,     // collecting framed replies
+    SCAN_FINISHED
+} scan_stage_t;
+
+// One peer being scanned
+typedef struct {
+    int fd;
+    int port;
+    scan_stage_t stage;
+    bool from_pool;      // reused pooled session; a fresh one is tried if it turns out dead
+    std::string out;     // request bytes still to send
+    std::string in;      // reply bytes received so far
+    int replies_left;    // framed replies still expected (greeting + request)
+    double deadline;
+    scan_reply_fn on_reply; // set for multi-request scans such as paged listings
+    void* reply_arg;
+} scan_peer_t;
+
+// Client-side connection pool, keyed by seed port
+typedef struct {
+    long long reuses;   // requests served by an already open session
+    long long misses;   // sessions that had to be opened (one handshake each)
+    long long discards; // sessions closed because they were stale or broken
+} pool_stats_t;
+
+std::map<int, std::vector<seed_session_t*> > connection_pool;
+pool_stats_t pool_stats = {0, 0, 0};
+std::set<int> text_only_ports; // seeds that predate the wire protocol
+pthread_mutex_t connection_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-port transfer estimate from live downloads, kept across downloads
+typedef struct {
+    double throughput;  // EWMA bytes per second while a piece is transferring
+    double latency;     // EWMA seconds to first byte
+    int samples;
+    int failures;
+} seed_score_t;
+
+std::map<int, seed_score_t> seed_scores;
+pthread_mutex_t seed_score_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Seed-side index of the files we share, built at startup and kept
+// current by inotify so requests are answered without touching the disk
+typedef struct {
+    long long size;
+    time_t mtime;
+    std::string digest;  // hashed in the background after the first LISTX DIGEST, dropped when the file changes
+} own_file_t;
+
+std::map<std::string, own_file_t> own_files;  // by name, so LISTX can page in name order
+pthread_rwlock_t own_files_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Files waiting for the digest thread, so no reactor ever reads a whole file
+std::deque<std::string> digest_queue;
+std::set<std::string> digest_pending;  // queued or being hashed
+pthread_mutex_t digest_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t digest_ready = PTHREAD_COND_INITIALIZER;
+pthread_once_t digest_thread_once = PTHREAD_ONCE_INIT;
+
+// Lock-free bitmap with one bit per chunk
+typedef struct {
+    std::atomic<uint64_t>* words;
+    int word_count;
+    int bit_count;
+} chunk_bitmap_t;
+
+// One ranged DOWNLOAD waiting for its reply
+typedef struct {
+    int first_chunk;
+    int chunk_count;
+    long long offset;
+    long long length;
+    double sent_at;
+    bool duplicate;                     // endgame copy of a piece another seed holds
+} piece_request_t;
+
+// Per-seed state of one parallel download
+typedef struct {
+    int port;
+    std::atomic<uint64_t> range;        // packed [begin, end) of chunks not yet taken
+    std::atomic<bool> failed;
+    std::atomic<bool> finished;         // worker has exited, failed or not
+    std::atomic<int> chunks;            // chunks this seed delivered
+    std::atomic<int> pieces;
+    std::atomic<int> steals;
+    std::atomic<long long> piece_size;  // bytes asked for in the next DOWNLOAD
+    std::atomic<long long> bandwidth;   // smoothed bytes per second
+    double rtt;                         // smoothed seconds to first byte (worker only)
+    std::atomic<int> duplicates_sent;
+    std::atomic<int> duplicates_won;
+    // Guarded by the context's inflight_mutex so other workers can cancel us
+    std::deque<piece_request_t> in_flight; // pieces requested on the session, in order
+    int session_fd;                     // -1 while no session is open
+    bool cancelled;                     // session shut down because its pieces were won elsewhere
+} seed_worker_state_t;
+
+// Shared state of one parallel download
+typedef struct {
+    const char* filename;
+    std::vector<int> seeds;
+    int seed_count;
+    int file_fd;                        // preallocated <name>.part, written with pwrite
+    long long file_size;
+    long long chunk_size;
+    int total_chunks;
+    chunk_bitmap_t claimed;             // chunk handed to a worker
+    chunk_bitmap_t done;                // chunk written to disk
+    chunk_bitmap_t duplicated;          // chunk requested a second time in endgame
+    seed_worker_state_t* workers;       // one per seed
+    int map_fd;                         // <name>.part.map resume sidecar, -1 if unavailable
+    std::atomic<int> active_workers;
+    std::atomic<int> completed_chunks;
+    std::atomic<long long> downloaded_bytes;
+    std::atomic<bool> write_failed;
+    std::atomic<bool> endgame;
+    std::atomic<long long> wasted_bytes; // duplicate bytes that lost the race
+    pthread_mutex_t inflight_mutex;
+    pthread_cond_t work_changed;        // signalled with inflight_mutex held
+    std::atomic<uint64_t> work_epoch;   // bumped on every signal, so idle workers miss none
+} parallel_ctx_t;
+
+typedef struct {
+    parallel_ctx_t* ctx;
+    int seed_index;
+} worker_arg_t;
+
+// Header of the <name>.part.map sidecar; the done bitmap words follow it.
+// Only chunks already flushed to the .part file are ever marked in it.
+typedef struct {
+    char magic[8];
+    int64_t file_size;
+    int64_t chunk_size;
+    int64_t total_chunks;
+} resume_map_header_t;
+
+const char RESUME_MAP_MAGIC[8] = {'S', 'E', 'E', 'D', 'M', 'A', 'P', '1'};
+
+typedef enum {
+    DOWNLOAD_QUEUED,
+    DOWNLOAD_RUNNING,
+    DOWNLOAD_DONE,
+    DOWNLOAD_FAILED
+} download_state_t;
+
+// One download task; fields are guarded by download_thread_mutex
 typedef struct {
+    int id;
+    int priority;                       // higher starts first, FIFO within a priority
+    download_state_t state;
     char filename[MAX_FILENAME_LENGTH];
     std::vector<int>* available_seeds;
+    long long expected_size;            // size known when queued, -1 to ask a seed
     pthread_t thread_id;
-    bool is_active;
     long long total_size;
     long long downloaded_bytes;
     int total_chunks;
     int completed_chunks;
+    parallel_ctx_t* transfer;           // engine state while the transfer runs, for status
 } download_thread_data_t;
 
-// Global download thread management
-download_thread_data_t active_download;
+// Global download manager. Tasks are never freed so the status screen can
+// list finished ones; waiting tasks are ordered by (-priority, id).
+std::vector<download_thread_data_t*> download_tasks;
+std::map<std::pair<int, int>, download_thread_data_t*> download_queue;
+int running_downloads = 0;
+int next_download_id = 1;
 pthread_mutex_t download_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Shared bandwidth budget: the time at which the bytes handed out so far
+// will have been paid for
+double bandwidth_clock = 0;
+pthread_mutex_t bandwidth_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 // Function prototypes
-void init_client_logging();
-void init_server_logging();
 void log_client(const std::string& message);
 void log_server(const std::string& message);
 void close_client_logging();
@@ -86,10 +745,25 @@ void close_server_logging();
 std::string get_timestamp();
 std::string format_file_size(long long bytes);
 void* download_thread_worker(void* arg);
-void scan_seeds_for_file(const char* filename, std::vector<int>& available_seeds);
-void download_file_round_robin(const char* filename, const std::vector<int>& available_seeds);
+long long scan_seeds_for_file(const char* filename, std::vector<int>& available_seeds);
+bool parallel_download(download_thread_data_t* task);
+void queue_file_download(const char* filename, int file_choice, int priority);
+void refresh_catalog_async();
+void wait_for_bandwidth(long long bytes);
+double monotonic_seconds();
+long long monotonic_ns();
 void show_progress_bar(long long current, long long total, int bar_width = 50);
 long long get_file_size_from_seed(int port, const char* filename);
+seed_session_t* acquire_seed_session(int port, bool binary);
+void release_seed_session(seed_session_t* session, bool reusable);
+seed_call_result_t seed_call(int port, const char* command, bool* ok, std::string& payload);
+void scan_peers(const char* command, std::vector<scan_result_t>& results, const std::vector<int>* ports = NULL,
+                scan_reply_fn on_reply = NULL, void* reply_arg = NULL);
+void scan_listings(std::vector<scan_result_t>& results, listing_entry_fn on_entry, void* arg);
+bool parse_listing_line(char* line, listing_entry_t* entry);
+std::string connection_pool_summary();
+long long log_drop_count();
+void invalidate_file_fd(const char* name);
 bool check_file_already_exists(const char* filename, long long expected_size, char* existing_path, size_t path_size);
 
 void setup_socket_addr(struct sockaddr_in* addr, int port) {
@@ -168,738 +842,4123 @@ std::string format_file_size(long long bytes) {
     return std::string(buffer);
 }
 
-void init_client_logging() {
-    if (client_logging_active) return; // Already initialized
-    
-    std::string timestamp = get_timestamp();
-    client_log_filename = "download_file_" + get_timestamp() + "_port" + std::to_string(my_bound_port) + ".log";
-    
-    pthread_mutex_lock(&client_log_mutex);
-    client_log_file.open(client_log_filename, std::ios::out | std::ios::app);
-    
-    if (client_log_file.is_open()) {
-        client_logging_active = true;
-        
-        time_t now = time(0);
-        struct tm* timeinfo = localtime(&now);
-        char timestamp_str[80];
-        strftime(timestamp_str, sizeof(timestamp_str), "%Y-%m-%d %H:%M:%S", timeinfo);
-        
-        client_log_file << "[" << timestamp_str << "] === DOWNLOAD SESSION STARTED ===" << std::endl;
-        client_log_file << "[" << timestamp_str << "] Client bound to port: " << my_bound_port << std::endl;
-        client_log_file.flush();
-        
+// ===== LOGGING =====
+
+// Thread exit hands the ring back for the next thread to reuse; anything
+// still in it is drained as usual
+void release_log_ring(void* ring) {
+    ((log_ring_t*)ring)->owned.store(false, std::memory_order_release);
+}
+
+// The calling thread's ring: a free one left by an exited thread, or a new one
+log_ring_t* thread_log_ring() {
+    auto ring = (log_ring_t*)pthread_getspecific(log_ring_key);
+    if (ring != NULL) {
+        return ring;
+    }
+    for (ring = log_rings.load(std::memory_order_acquire); ring != NULL; ring = ring->next) {
+        auto owned = false;
+        if (!ring->owned.load(std::memory_order_relaxed) &&
+            ring->owned.compare_exchange_strong(owned, true, std::memory_order_acquire)) {
+            break;
+        }
     }
-    pthread_mutex_unlock(&client_log_mutex);
+    if (ring == NULL) {
+        ring = new log_ring_t();
+        ring->head.store(0);
+        ring->tail.store(0);
+        ring->owned.store(true);
+        for (auto target = 0; target < LOG_TARGETS; target++) {
+            ring->dropped[target].store(0);
+        }
+        ring->next = log_rings.load(std::memory_order_relaxed);
+        while (!log_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release)) {
+        }
+    }
+    pthread_setspecific(log_ring_key, ring);
+    return ring;
 }
 
-void init_server_logging() {
-    if (server_logging_active) return; // Already initialized
-    
-    std::string timestamp = get_timestamp();
-    server_log_filename = "seedapp_port" + std::to_string(my_bound_port) + "_log_" + timestamp + ".txt";
-    
-    pthread_mutex_lock(&server_log_mutex);
-    server_log_file.open(server_log_filename, std::ios::out | std::ios::app);
-    
-    if (server_log_file.is_open()) {
-        server_logging_active = true;
-        
-        time_t now = time(0);
-        struct tm* timeinfo = localtime(&now);
-        char timestamp_str[80];
-        strftime(timestamp_str, sizeof(timestamp_str), "%Y-%m-%d %H:%M:%S", timeinfo);
-        
-        server_log_file << "[" << timestamp_str << "] === SEED SERVER LOG STARTED ===" << std::endl;
-        server_log_file << "[" << timestamp_str << "] Server listening on port: " << my_bound_port << std::endl;
-        server_log_file.flush();
-        
+// Total messages dropped because a ring was full
+long long log_drop_count() {
+    long long dropped = 0;
+    for (auto ring = log_rings.load(std::memory_order_acquire); ring != NULL; ring = ring->next) {
+        for (auto target = 0; target < LOG_TARGETS; target++) {
+            dropped += ring->dropped[target].load(std::memory_order_relaxed);
+        }
     }
-    pthread_mutex_unlock(&server_log_mutex);
+    return dropped;
 }
 
-void log_client(const std::string& message) {
-    if (!client_logging_active) {
-        init_client_logging();
+void* log_writer(void* arg);
+
+void start_log_writer() {
+    pthread_key_create(&log_ring_key, release_log_ring);
+    if (pthread_create(&log_writer_thread, NULL, log_writer, NULL) == 0) {
+        log_writer_running.store(true);
     }
+}
+
+// Copy one message into the calling thread's ring, spread over as many
+// records as it needs. All or nothing: if the ring can't take the whole
+// message it is dropped.
+void push_log_record(log_target_t target, log_kind_t kind, const std::string& message) {
+    pthread_once(&log_writer_once, start_log_writer);
+    auto ring = thread_log_ring();
     
-    pthread_mutex_lock(&client_log_mutex);
-    if (client_log_file.is_open()) {
-        time_t now = time(0);
-        struct tm* timeinfo = localtime(&now);
-        char timestamp[80];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
-        
-        client_log_file << "[" << timestamp << "] " << message << std::endl;
-        client_log_file.flush();
+    auto needed = message.empty() ? 1 : (message.size() + LOG_RECORD_TEXT - 1) / LOG_RECORD_TEXT;
+    auto head = ring->head.load(std::memory_order_relaxed);
+    auto tail = ring->tail.load(std::memory_order_acquire);
+    if (head - tail + needed > (size_t)LOG_RING_RECORDS) {
+        ring->dropped[target].fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    
+    struct timespec when;
+    clock_gettime(CLOCK_REALTIME, &when);
+    size_t copied = 0;
+    for (size_t i = 0; i < needed; i++) {
+        auto& record = ring->records[(head + i) % LOG_RING_RECORDS];
+        auto length = std::min(LOG_RECORD_TEXT, message.size() - copied);
+        record.when = when;
+        record.target = target;
+        record.kind = kind;
+        record.more = i + 1 < needed;
+        record.length = length;
+        memcpy(record.text, message.data() + copied, length);
+        copied += length;
     }
-    pthread_mutex_unlock(&client_log_mutex);
+    ring->head.store(head + needed, std::memory_order_release);
 }
 
-void log_server(const std::string& message) {
-    if (!server_logging_active) {
-        init_server_logging();
+// One drained message, waiting to be written
+typedef struct {
+    struct timespec when;
+    int target;
+    int kind;
+    std::string text;
+} log_entry_t;
+
+bool log_entry_before(const log_entry_t& a, const log_entry_t& b) {
+    return a.when.tv_sec != b.when.tv_sec ? a.when.tv_sec < b.when.tv_sec : a.when.tv_nsec < b.when.tv_nsec;
+}
+
+// Move every complete message out of the rings
+void drain_log_rings(std::vector<log_entry_t>& entries, long long* dropped) {
+    for (auto ring = log_rings.load(std::memory_order_acquire); ring != NULL; ring = ring->next) {
+        auto head = ring->head.load(std::memory_order_acquire);
+        auto tail = ring->tail.load(std::memory_order_relaxed);
+        while (tail != head) {
+            auto& first = ring->records[tail % LOG_RING_RECORDS];
+            log_entry_t entry;
+            entry.when = first.when;
+            entry.target = first.target;
+            entry.kind = first.kind;
+            while (1) {
+                auto& record = ring->records[tail % LOG_RING_RECORDS];
+                entry.text.append(record.text, record.length);
+                tail++;
+                if (!record.more) {
+                    break;
+                }
+            }
+            entries.push_back(entry);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        for (auto target = 0; target < LOG_TARGETS; target++) {
+            dropped[target] += ring->dropped[target].load(std::memory_order_relaxed);
+        }
     }
-    
-    pthread_mutex_lock(&server_log_mutex);
-    if (server_log_file.is_open()) {
-        time_t now = time(0);
-        struct tm* timeinfo = localtime(&now);
+}
+
+// "[YYYY-mm-dd HH:MM:SS] ", formatted once per second
+const char* log_line_prefix(time_t second) {
+    static time_t cached_second = -1;
+    static char prefix[96];
+    if (second != cached_second) {
+        struct tm timeinfo;
+        localtime_r(&second, &timeinfo);
         char timestamp[80];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
-        
-        server_log_file << "[" << timestamp << "] " << message << std::endl;
-        server_log_file.flush();
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &timeinfo);
+        snprintf(prefix, sizeof(prefix), "[%s] ", timestamp);
+        cached_second = second;
     }
-    pthread_mutex_unlock(&server_log_mutex);
+    return prefix;
 }
 
-void close_client_logging() {
-    pthread_mutex_lock(&client_log_mutex);
-    if (client_log_file.is_open() && client_logging_active) {
-        time_t now = time(0);
-        struct tm* timeinfo = localtime(&now);
-        char timestamp[80];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
-        
-        client_log_file << "[" << timestamp << "] === DOWNLOAD SESSION ENDED ===" << std::endl;
-        client_log_file.close();
-        client_logging_active = false;
+// Open a target's file on its first message, with the usual banner
+void open_log_file(int target, time_t second) {
+    auto& file = target == LOG_TO_CLIENT ? client_log_file : server_log_file;
+    if (file.is_open()) {
+        return;
+    }
+    struct tm timeinfo;
+    localtime_r(&second, &timeinfo);
+    char timestamp[80];
+    strftime(timestamp, sizeof(timestamp), "%Y%m%d_%H%M%S", &timeinfo);
+    
+    if (target == LOG_TO_CLIENT) {
+        client_log_filename = "download_file_" + std::string(timestamp) + "_port" + std::to_string(my_bound_port) + ".log";
+        client_log_file.open(client_log_filename, std::ios::out | std::ios::app);
+        client_log_file << log_line_prefix(second) << "=== DOWNLOAD SESSION STARTED ===\n";
+        client_log_file << log_line_prefix(second) << "Client bound to port: " << my_bound_port << "\n";
+    } else {
+        server_log_filename = "seedapp_port" + std::to_string(my_bound_port) + "_log_" + std::string(timestamp) + ".txt";
+        server_log_file.open(server_log_filename, std::ios::out | std::ios::app);
+        server_log_file << log_line_prefix(second) << "=== SEED SERVER LOG STARTED ===\n";
+        server_log_file << log_line_prefix(second) << "Server listening on port: " << my_bound_port << "\n";
     }
-    pthread_mutex_unlock(&client_log_mutex);
 }
 
-void close_server_logging() {
-    pthread_mutex_lock(&server_log_mutex);
-    if (server_log_file.is_open() && server_logging_active) {
-        time_t now = time(0);
-        struct tm* timeinfo = localtime(&now);
-        char timestamp[80];
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", timeinfo);
-        
-        server_log_file << "[" << timestamp << "] === SEED SERVER LOG ENDED ===" << std::endl;
-        server_log_file.close();
-        server_logging_active = false;
+void close_log_file(int target, time_t second) {
+    auto& file = target == LOG_TO_CLIENT ? client_log_file : server_log_file;
+    if (!file.is_open()) {
+        return;
+    }
+    if (target == LOG_TO_CLIENT) {
+        file << log_line_prefix(second) << "=== DOWNLOAD SESSION ENDED ===\n";
+    } else {
+        file << log_line_prefix(second) << "=== SEED SERVER LOG ENDED ===\n";
         std::cout << "Server logging ended: " << server_log_filename << std::endl;
     }
-    pthread_mutex_unlock(&server_log_mutex);
+    file.close();
 }
 
-// Download thread worker function
-void* download_thread_worker(void* arg) {
-    download_thread_data_t* download_data = (download_thread_data_t*)arg;
-    
-    log_client("Background download thread started for file: " + std::string(download_data->filename));
-    
-    // Perform the actual download
-    download_file_round_robin(download_data->filename, *(download_data->available_seeds));
-    
-    // Clean up
-    pthread_mutex_lock(&download_thread_mutex);
-    delete download_data->available_seeds;
-    download_data->is_active = false;
-    pthread_mutex_unlock(&download_thread_mutex);
-    
-    log_client("Background download thread completed for file: " + std::string(download_data->filename));
+// Drains the rings and writes each batch with one flush per file. Runs
+// until stop_log_writer(), then writes whatever is left.
+void* log_writer(void* arg) {
+    (void)arg;
+    std::vector<log_entry_t> entries;
+    long long reported_drops[LOG_TARGETS] = {0, 0};
     
+    while (1) {
+        auto stopping = log_writer_stop.load(std::memory_order_acquire);
+        long long dropped[LOG_TARGETS] = {0, 0};
+        entries.clear();
+        drain_log_rings(entries, dropped);
+        std::stable_sort(entries.begin(), entries.end(), log_entry_before);
+        
+        for (auto& entry : entries) {
+            auto& file = entry.target == LOG_TO_CLIENT ? client_log_file : server_log_file;
+            if (entry.kind == LOG_CLOSE) {
+                close_log_file(entry.target, entry.when.tv_sec);
+                continue;
+            }
+            open_log_file(entry.target, entry.when.tv_sec);
+            file << log_line_prefix(entry.when.tv_sec);
+            file.write(entry.text.data(), entry.text.size());
+            file << '\n';
+        }
+        
+        auto now = time(0);
+        for (auto target = 0; target < LOG_TARGETS; target++) {
+            auto& file = target == LOG_TO_CLIENT ? client_log_file : server_log_file;
+            if (dropped[target] > reported_drops[target] && file.is_open()) {
+                file << log_line_prefix(now) << "=== " << (dropped[target] - reported_drops[target])
+                     << " log message(s) dropped, log ring full ===\n";
+                reported_drops[target] = dropped[target];
+            }
+            if (file.is_open()) {
+                file.flush();
+            }
+        }
+        
+        if (stopping) {
+            break;
+        }
+        if (entries.empty()) {
+            usleep(LOG_WRITER_IDLE_US);
+        }
+    }
     return NULL;
 }
 
-// //Checks if a port is available by attempting a temporary bind
-// int is_port_available(int port) {
-//     int sock = socket(AF_INET, SOCK_STREAM, 0);
-//     if (sock < 0) {
-//         return 0;
-//     }
+// Write out everything logged so far and stop the writer (at exit)
+void stop_log_writer() {
+    if (!log_writer_running.load()) {
+        return;
+    }
+    log_writer_stop.store(true, std::memory_order_release);
+    pthread_join(log_writer_thread, NULL);
+    log_writer_running.store(false);
+}
 
-//     struct sockaddr_in addr;
-//     setup_socket_addr(&addr, port);
+void log_client(const std::string& message) {
+    push_log_record(LOG_TO_CLIENT, LOG_MESSAGE, message);
+}
 
-//     int result = bind(sock, (struct sockaddr*)&addr, sizeof(addr)); 
-//     close(sock);
+void log_server(const std::string& message) {
+    push_log_record(LOG_TO_SERVER, LOG_MESSAGE, message);
+}
 
-//     return result == 0;
-// }
+// Closing is queued behind the messages already logged; the next message
+// opens a new file
+void close_client_logging() {
+    push_log_record(LOG_TO_CLIENT, LOG_CLOSE, "");
+}
 
-//This will permanently bind to the port and starts listening
-int bind_and_listen(int port) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        return -1;
+void close_server_logging() {
+    push_log_record(LOG_TO_SERVER, LOG_CLOSE, "");
+}
+
+// ===== METRICS =====
+// Counters, gauges and fixed-bucket histograms, registered by name and
+// labels and updated with relaxed atomics on the hot paths. STATS and the
+// menu print the whole registry in the Prometheus text format, so
+// monitoring can scrape any seed without reading its logs.
+
+// Find or create a metric. Hot paths look their metrics up once and keep
+// the pointer; metrics are never freed.
+metric_t* get_metric(const char* name, const std::string& labels, metric_kind_t kind) {
+    auto key = std::string(name) + "{" + labels + "}";
+    pthread_mutex_lock(&metric_registry_mutex);
+    auto it = metric_registry.find(key);
+    if (it != metric_registry.end()) {
+        pthread_mutex_unlock(&metric_registry_mutex);
+        return it->second;
     }
+    auto metric = new metric_t();
+    metric->name = name;
+    metric->labels = labels;
+    metric->kind = kind;
+    metric->value.store(0);
+    metric->count.store(0);
+    metric->reader = NULL;
+    metric->latency = NULL;
+    for (auto i = 0; i < METRIC_BUCKETS; i++) {
+        metric->buckets[i].store(0);
+    }
+    if (kind == METRIC_SUMMARY) {
+        metric->latency = new latency_histogram_t();
+        for (auto i = 0; i < LATENCY_BUCKETS; i++) {
+            metric->latency->counts[i].store(0);
+        }
+    }
+    metric_registry[key] = metric;
+    pthread_mutex_unlock(&metric_registry_mutex);
+    return metric;
+}
 
-    int opt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+// A gauge whose value is read from existing state when the registry is printed
+void register_metric_reader(const char* name, metric_kind_t kind, long long (*reader)()) {
+    get_metric(name, "", kind)->reader = reader;
+}
 
-    struct sockaddr_in addr;
-    setup_socket_addr(&addr, port);
+void metric_add(metric_t* metric, long long amount) {
+    metric->value.fetch_add(amount, std::memory_order_relaxed);
+}
 
-    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(sock);
-        return -1;
-    }
+void metric_set(metric_t* metric, long long value) {
+    metric->value.store(value, std::memory_order_relaxed);
+}
 
-    if (listen(sock, 5) < 0) {
-        close(sock);
-        return -1;
+// Record one duration, in microseconds
+void metric_observe(metric_t* metric, long long micros) {
+    auto bucket = 0;
+    while (bucket < METRIC_BUCKETS - 1 && micros > METRIC_BUCKET_BOUNDS[bucket]) {
+        bucket++;
     }
-
-    return sock;
+    metric->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    metric->value.fetch_add(micros, std::memory_order_relaxed);
+    metric->count.fetch_add(1, std::memory_order_relaxed);
 }
 
-//this will help prevent duplicates
-void add_unique_file(const char* filename, int source_port) {
-    pthread_mutex_lock(&file_list_mutex);
-    
-    for (auto i = 0; i < unique_file_count; i++) {
-        if (strcmp(unique_files[i].filename, filename) == 0) {
-            pthread_mutex_unlock(&file_list_mutex);
-            return;
-        }
+// Bucket of a latency in nanoseconds: values below LATENCY_SUB_BUCKETS are
+// exact, larger ones keep their top LATENCY_SUB_BITS + 1 bits
+int latency_bucket(long long ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return ns < 0 ? 0 : (int)ns;
     }
-    
-    if (unique_file_count < MAX_FILES) {
-        // Safe string copy with bounds checking
-        if (strlen(filename) < MAX_FILENAME_LENGTH) {
-            strncpy(unique_files[unique_file_count].filename, filename, MAX_FILENAME_LENGTH - 1);
-            unique_files[unique_file_count].filename[MAX_FILENAME_LENGTH - 1] = '\0'; // Ensure null termination
-            unique_files[unique_file_count].source_port = source_port;
-            unique_file_count++;
-        }
+    if (ns >= (1LL << LATENCY_MAX_BITS)) {
+        ns = (1LL << LATENCY_MAX_BITS) - 1;
     }
-    pthread_mutex_unlock(&file_list_mutex);
+    auto shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return LATENCY_SUB_BUCKETS * (shift + 1) + (int)(ns >> shift) - LATENCY_SUB_BUCKETS;
 }
 
-// Get files from our own folder (for serving to other ports)
-void get_own_files(char* response, int max_size) {
-    auto my_folder_id = -1;
-
+// Largest value that lands in `bucket`
+long long latency_bucket_limit(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    auto shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    auto mantissa = (long long)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void latency_observe(metric_t* metric, long long ns) {
+    metric->latency->counts[latency_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    metric->value.fetch_add(ns, std::memory_order_relaxed);
+    metric->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Value below which `quantile` of the recorded latencies fall, in nanoseconds
+long long latency_quantile(metric_t* metric, double quantile) {
+    long long counts[LATENCY_BUCKETS];
+    long long total = 0;
+    for (auto i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = metric->latency->counts[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    auto rank = (long long)(quantile * total);
+    if (rank < quantile * total) {
+        rank++;
+    }
+    long long seen = 0;
+    for (auto i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return latency_bucket_limit(i);
+        }
+    }
+    return latency_bucket_limit(LATENCY_BUCKETS - 1);
+}
+
+void observe_seed_stage(seed_stage_t stage, long long ns) {
+    latency_observe(seed_stage_metrics[stage], ns);
+}
+
+// Start answering a request: counted now, timed until its reply is sent
+void begin_seed_request(connection_t* conn, seed_command_t command) {
+    conn->command = command;
+    metric_add(seed_request_metrics[command], 1);
+}
+
+long long read_active_connections() {
+    return active_connections.load();
+}
+
+long long read_accepted_connections() {
+    long long accepted = 0;
+    for (size_t i = 0; i < acceptors.size(); i++) {
+        accepted += acceptors[i]->accepted.load();
+    }
+    return accepted;
+}
+
+long long read_rejected_connections() {
+    long long rejected = 0;
+    for (size_t i = 0; i < acceptors.size(); i++) {
+        rejected += acceptors[i]->rejected.load();
+    }
+    return rejected;
+}
+
+void init_metrics() {
+    for (auto i = 0; i < SEED_COMMANDS; i++) {
+        seed_request_metrics[i] = get_metric("seed_requests_total", "command=\"" + std::string(SEED_COMMAND_NAMES[i]) + "\"", METRIC_COUNTER);
+    }
+    seed_bytes_sent_metric = get_metric("seed_bytes_sent_total", "", METRIC_COUNTER);
+    client_bytes_received_metric = get_metric("client_bytes_received_total", "", METRIC_COUNTER);
+    client_piece_latency_metric = get_metric("client_piece_fetch_seconds", "", METRIC_HISTOGRAM);
+    for (auto i = 0; i < SEED_COMMANDS; i++) {
+        seed_latency_metrics[i] = get_metric("seed_request_seconds", "command=\"" + std::string(SEED_COMMAND_NAMES[i]) + "\"", METRIC_SUMMARY);
+    }
+    for (auto i = 0; i < SEED_STAGES; i++) {
+        seed_stage_metrics[i] = get_metric("seed_stage_seconds", "stage=\"" + std::string(SEED_STAGE_NAMES[i]) + "\"", METRIC_SUMMARY);
+    }
+    register_metric_reader("seed_active_connections", METRIC_GAUGE, read_active_connections);
+    register_metric_reader("seed_connections_accepted_total", METRIC_COUNTER, read_accepted_connections);
+    register_metric_reader("seed_connections_rejected_total", METRIC_COUNTER, read_rejected_connections);
+    register_metric_reader("log_messages_dropped_total", METRIC_COUNTER, log_drop_count);
+}
+
+// Seconds from microseconds, as Prometheus expects durations
+std::string format_metric_seconds(long long micros) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%g", micros / 1e6);
+    return std::string(buffer);
+}
+
+// Seconds from nanoseconds, for the summaries. Sub-microsecond stages
+// would read as 0 if rounded to microseconds first.
+std::string format_metric_seconds_ns(long long ns) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%g", ns / 1e9);
+    return std::string(buffer);
+}
+
+// The registry in the Prometheus text exposition format
+void render_metrics(std::string& out) {
+    static const char* kind_names[] = {"counter", "gauge", "histogram", "summary"};
+    std::string last_name;
+    
+    pthread_mutex_lock(&metric_registry_mutex);
+    for (auto it = metric_registry.begin(); it != metric_registry.end(); ++it) {
+        auto metric = it->second;
+        if (metric->name != last_name) {
+            out += "# TYPE " + metric->name + " " + kind_names[metric->kind] + "\n";
+            last_name = metric->name;
+        }
+        auto labels = metric->labels.empty() ? std::string() : "{" + metric->labels + "}";
+        if (metric->kind == METRIC_COUNTER || metric->kind == METRIC_GAUGE) {
+            auto value = metric->reader != NULL ? metric->reader() : metric->value.load(std::memory_order_relaxed);
+            out += metric->name + labels + " " + std::to_string(value) + "\n";
+            continue;
+        }
+        
+        auto separator = metric->labels.empty() ? "" : ",";
+        if (metric->kind == METRIC_SUMMARY) {
+            for (auto i = 0; i < LATENCY_QUANTILE_COUNT; i++) {
+                char quantile[16];
+                snprintf(quantile, sizeof(quantile), "%g", LATENCY_QUANTILES[i]);
+                out += metric->name + "{" + metric->labels + separator + "quantile=\"" + quantile + "\"} " +
+                       format_metric_seconds_ns(latency_quantile(metric, LATENCY_QUANTILES[i])) + "\n";
+            }
+            out += metric->name + "_sum" + labels + " " + format_metric_seconds_ns(metric->value.load(std::memory_order_relaxed)) + "\n";
+            out += metric->name + "_count" + labels + " " + std::to_string(metric->count.load(std::memory_order_relaxed)) + "\n";
+            continue;
+        }
+        long long cumulative = 0;
+        for (auto i = 0; i < METRIC_BUCKETS; i++) {
+            cumulative += metric->buckets[i].load(std::memory_order_relaxed);
+            auto bound = i < METRIC_BUCKETS - 1 ? format_metric_seconds(METRIC_BUCKET_BOUNDS[i]) : std::string("+Inf");
+            out += metric->name + "_bucket{" + metric->labels + separator + "le=\"" + bound + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        out += metric->name + "_sum" + labels + " " + format_metric_seconds(metric->value.load(std::memory_order_relaxed)) + "\n";
+        out += metric->name + "_count" + labels + " " + std::to_string(metric->count.load(std::memory_order_relaxed)) + "\n";
+    }
+    pthread_mutex_unlock(&metric_registry_mutex);
+}
+
+std::string format_latency(long long ns) {
+    char buffer[32];
+    if (ns < 1000) {
+        snprintf(buffer, sizeof(buffer), "%lldns", ns);
+    } else if (ns < 1000000) {
+        snprintf(buffer, sizeof(buffer), "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buffer, sizeof(buffer), "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%.2fs", ns / 1e9);
+    }
+    return std::string(buffer);
+}
+
+void show_latency_line(const char* name, metric_t* metric) {
+    auto count = metric->count.load(std::memory_order_relaxed);
+    if (count == 0) {
+        return;
+    }
+    std::cout << "    " << std::left << std::setw(10) << name << std::right << std::setw(9) << count;
+    for (auto i = 0; i < LATENCY_QUANTILE_COUNT; i++) {
+        std::cout << std::setw(11) << format_latency(latency_quantile(metric, LATENCY_QUANTILES[i]));
+    }
+    std::cout << std::endl;
+}
+
+void show_metrics() {
+    std::string metrics;
+    render_metrics(metrics);
+    std::cout << "\nMetrics:\n" << metrics;
+    
+    std::cout << "\nSeed latency        count        p50        p90        p99      p99.9" << std::endl;
+    for (auto i = 0; i < SEED_COMMANDS; i++) {
+        show_latency_line(SEED_COMMAND_NAMES[i], seed_latency_metrics[i]);
+    }
+    for (auto i = 0; i < SEED_STAGES; i++) {
+        show_latency_line(SEED_STAGE_NAMES[i], seed_stage_metrics[i]);
+    }
+}
+
+// Start waiting tasks until the concurrency cap is reached.
+// Caller must hold download_thread_mutex.
+void start_queued_downloads() {
+    while (running_downloads < max_concurrent_downloads && !download_queue.empty()) {
+        auto task = download_queue.begin()->second;
+        download_queue.erase(download_queue.begin());
+        
+        task->state = DOWNLOAD_RUNNING;
+        running_downloads++;
+        if (pthread_create(&task->thread_id, NULL, download_thread_worker, task) != 0) {
+            LOG_CLIENT(LOG_ERROR, "Error: Failed to create download thread for " + std::string(task->filename));
+            task->state = DOWNLOAD_FAILED;
+            running_downloads--;
+            delete task->available_seeds;
+            task->available_seeds = NULL;
+            continue;
+        }
+        
+        // Detach thread so it runs independently
+        pthread_detach(task->thread_id);
+    }
+}
+
+// Queue a download. Returns the task id, or -1 if the file is already
+// queued or downloading.
+int submit_download(const char* filename, const std::vector<int>& available_seeds, long long expected_size, int priority) {
+    pthread_mutex_lock(&download_thread_mutex);
+    for (size_t i = 0; i < download_tasks.size(); i++) {
+        auto state = download_tasks[i]->state;
+        if ((state == DOWNLOAD_QUEUED || state == DOWNLOAD_RUNNING) &&
+            strcmp(download_tasks[i]->filename, filename) == 0) {
+            pthread_mutex_unlock(&download_thread_mutex);
+            return -1;
+        }
+    }
+    
+    auto task = new download_thread_data_t;
+    task->id = next_download_id++;
+    task->priority = priority;
+    task->state = DOWNLOAD_QUEUED;
+    strncpy(task->filename, filename, MAX_FILENAME_LENGTH - 1);
+    task->filename[MAX_FILENAME_LENGTH - 1] = '\0';
+    task->available_seeds = new std::vector<int>(available_seeds);
+    task->expected_size = expected_size;
+    task->total_size = 0;
+    task->downloaded_bytes = 0;
+    task->total_chunks = 0;
+    task->completed_chunks = 0;
+    task->transfer = NULL;
+    
+    download_tasks.push_back(task);
+    download_queue[std::make_pair(-priority, task->id)] = task;
+    auto id = task->id;
+    start_queued_downloads();
+    pthread_mutex_unlock(&download_thread_mutex);
+    return id;
+}
+
+// Download thread worker function
+void* download_thread_worker(void* arg) {
+    download_thread_data_t* download_data = (download_thread_data_t*)arg;
+    
+    LOG_CLIENT(LOG_DEBUG, "Background download thread started for file: " + std::string(download_data->filename));
+    
+    // Perform the actual download
+    auto success = parallel_download(download_data);
+    
+    LOG_CLIENT(LOG_DEBUG, "Background download thread completed for file: " + std::string(download_data->filename));
+    
+    // Clean up and hand the slot to the next waiting task
+    pthread_mutex_lock(&download_thread_mutex);
+    delete download_data->available_seeds;
+    download_data->available_seeds = NULL;
+    download_data->state = success ? DOWNLOAD_DONE : DOWNLOAD_FAILED;
+    running_downloads--;
+    start_queued_downloads();
+    auto idle = running_downloads == 0;
+    pthread_mutex_unlock(&download_thread_mutex);
+    
+    // Close client logging once the last download is finished
+    if (idle) {
+        close_client_logging();
+    }
+    
+    return NULL;
+}
+
+// Block until `bytes` fit in the shared bandwidth budget
+void wait_for_bandwidth(long long bytes) {
+    if (bandwidth_limit <= 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&bandwidth_mutex);
+    auto now = monotonic_seconds();
+    if (bandwidth_clock < now - BANDWIDTH_BURST_SECONDS) {
+        bandwidth_clock = now - BANDWIDTH_BURST_SECONDS;
+    }
+    bandwidth_clock += (double)bytes / bandwidth_limit;
+    auto wait = bandwidth_clock - now;
+    pthread_mutex_unlock(&bandwidth_mutex);
+    
+    if (wait > 0) {
+        usleep((useconds_t)(wait * 1e6));
+    }
+}
+
+// //Checks if a port is available by attempting a temporary bind
+// int is_port_available(int port) {
+//     int sock = socket(AF_INET, SOCK_STREAM, 0);
+//     if (sock < 0) {
+//         return 0;
+//     }
+
+//     struct sockaddr_in addr;
+//     setup_socket_addr(&addr, port);
+
+//     int result = bind(sock, (struct sockaddr*)&addr, sizeof(addr)); 
+//     close(sock);
+
+//     return result == 0;
+// }
+
+// With SO_REUSEPORT a second seed could bind a port we already hold, which
+// would break port-based discovery. Holding an abstract unix socket named
+// after the port marks it as taken; returns -1 if another seed has it.
+int claim_port(int port) {
+    auto sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    auto name_length = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "seedapp-port-%d", port);
+    if (bind(sock, (struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + name_length) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Send small writes at once. Without this a pipelined request or a reply
+// header can sit in the kernel until the peer's delayed ACK, about 40 ms.
+void set_no_delay(int sock) {
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
+//This will permanently bind to the port and starts listening
+int bind_and_listen(int port, bool reuse_port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    setup_socket_addr(&addr, port);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    if (listen(sock, listen_backlog) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+void catalog_destroy(catalog_t* catalog) {
+    for (auto i = 0; i < CATALOG_SHARDS; i++) {
+        pthread_rwlock_destroy(&catalog->shards[i].lock);
+    }
+    pthread_mutex_destroy(&catalog->order_mutex);
+    delete catalog;
+}
+
+std::shared_ptr<catalog_t> catalog_create() {
+    auto catalog = new catalog_t();
+    for (auto i = 0; i < CATALOG_SHARDS; i++) {
+        pthread_rwlock_init(&catalog->shards[i].lock, NULL);
+    }
+    pthread_mutex_init(&catalog->order_mutex, NULL);
+    catalog->seeds_found = 0;
+    return std::shared_ptr<catalog_t>(catalog, catalog_destroy);
+}
+
+catalog_shard_t* catalog_shard(catalog_t* catalog, const std::string& filename) {
+    return &catalog->shards[std::hash<std::string>()(filename) % CATALOG_SHARDS];
+}
+
+// Record that `port` offers `filename`. Size, mtime and digest are filled
+// in from whichever seed reports them first; pass -1 / 0 / "" when unknown.
+// A seed whose copy differs in size or digest from the one already recorded
+// is not a seed of this file. Returns false in that case.
+bool catalog_add(catalog_t* catalog, const char* filename, int port, long long size, time_t mtime, const std::string& digest) {
+    std::string name(filename);
+    if (name.empty() || name.size() >= (size_t)MAX_FILENAME_LENGTH) {
+        return false;
+    }
+    
+    auto shard = catalog_shard(catalog, name);
+    pthread_rwlock_wrlock(&shard->lock);
+    auto it = shard->files.find(name);
+    if (it == shard->files.end()) {
+        catalog_entry_t entry;
+        entry.filename = name;
+        entry.seeds.push_back(port);
+        entry.size = size;
+        entry.mtime = mtime;
+        entry.digest = digest;
+        entry.refreshed_at = monotonic_seconds();
+        pthread_mutex_lock(&catalog->order_mutex);
+        catalog->order.push_back(name);
+        entry.id = catalog->order.size();
+        pthread_mutex_unlock(&catalog->order_mutex);
+        shard->files[name] = entry;
+    } else {
+        auto& entry = it->second;
+        if ((size >= 0 && entry.size >= 0 && size != entry.size) ||
+            (!digest.empty() && !entry.digest.empty() && digest != entry.digest)) {
+            pthread_rwlock_unlock(&shard->lock);
+            return false;
+        }
+        if (std::find(entry.seeds.begin(), entry.seeds.end(), port) == entry.seeds.end()) {
+            entry.seeds.push_back(port);
+        }
+        if (entry.size < 0) {
+            entry.size = size;
+        }
+        if (entry.mtime == 0) {
+            entry.mtime = mtime;
+        }
+        if (entry.digest.empty()) {
+            entry.digest = digest;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return true;
+}
+
+// Replace a file's seed list after a fresh scan for it, and restart its TTL
+void catalog_set_seeds(catalog_t* catalog, const std::string& filename, const std::vector<int>& seeds) {
+    auto shard = catalog_shard(catalog, filename);
+    pthread_rwlock_wrlock(&shard->lock);
+    auto it = shard->files.find(filename);
+    if (it != shard->files.end()) {
+        it->second.seeds = seeds;
+        it->second.refreshed_at = monotonic_seconds();
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+void catalog_set_size(catalog_t* catalog, const std::string& filename, long long size) {
+    auto shard = catalog_shard(catalog, filename);
+    pthread_rwlock_wrlock(&shard->lock);
+    auto it = shard->files.find(filename);
+    if (it != shard->files.end()) {
+        it->second.size = size;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+bool catalog_entry_is_fresh(const catalog_entry_t& entry) {
+    return monotonic_seconds() - entry.refreshed_at < catalog_ttl_seconds;
+}
+
+// Copy out one file's entry; returns false if the catalog doesn't have it
+bool catalog_lookup(catalog_t* catalog, const std::string& filename, catalog_entry_t* entry) {
+    auto shard = catalog_shard(catalog, filename);
+    pthread_rwlock_rdlock(&shard->lock);
+    auto it = shard->files.find(filename);
+    auto found = it != shard->files.end();
+    if (found) {
+        *entry = it->second;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return found;
+}
+
+// Entry by menu number
+bool catalog_entry_at(catalog_t* catalog, int id, catalog_entry_t* entry) {
+    pthread_mutex_lock(&catalog->order_mutex);
+    auto valid = id >= 1 && id <= (int)catalog->order.size();
+    std::string filename = valid ? catalog->order[id - 1] : "";
+    pthread_mutex_unlock(&catalog->order_mutex);
+    return valid && catalog_lookup(catalog, filename, entry);
+}
+
+int catalog_count(catalog_t* catalog) {
+    pthread_mutex_lock(&catalog->order_mutex);
+    auto count = (int)catalog->order.size();
+    pthread_mutex_unlock(&catalog->order_mutex);
+    return count;
+}
+
+std::shared_ptr<catalog_t> current_catalog() {
+    pthread_mutex_lock(&file_list_mutex);
+    auto catalog = file_catalog;
+    pthread_mutex_unlock(&file_list_mutex);
+    return catalog;
+}
+
+void publish_catalog(std::shared_ptr<catalog_t> catalog) {
+    pthread_mutex_lock(&file_list_mutex);
+    file_catalog = catalog;
+    pthread_mutex_unlock(&file_list_mutex);
+}
+
+// "8081, 8083" for the menus
+std::string format_seed_ports(const std::vector<int>& seeds) {
+    std::string ports;
+    for (size_t i = 0; i < seeds.size(); i++) {
+        if (i > 0) {
+            ports += ", ";
+        }
+        ports += std::to_string(seeds[i]);
+    }
+    return ports;
+}
+
+// One menu line for a catalog entry, without the [id] prefix
+std::string format_catalog_entry(const catalog_entry_t& entry) {
+    std::string line = entry.filename;
+    if (entry.size >= 0) {
+        line += " " + format_file_size(entry.size);
+    }
+    return line + " (from port " + format_seed_ports(entry.seeds) + ")";
+}
+
+// FNV-1a 64 over a file's contents, as 16 hex digits; empty if it can't be read
+std::string hash_file_contents(const char* path) {
+    auto fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return "";
+    }
+    uint64_t hash = 14695981039346656037ULL;
+    std::vector<unsigned char> buffer(DOWNLOAD_CHUNK_SIZE);
+    while (1) {
+        auto bytes = read(fd, buffer.data(), buffer.size());
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0) {
+            close(fd);
+            return "";
+        }
+        if (bytes == 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < bytes; i++) {
+            hash = (hash ^ buffer[i]) * 1099511628211ULL;
+        }
+    }
+    close(fd);
+    
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return hex;
+}
+
+// ===== OWN FILE INDEX =====
+// Every regular file directly in our shared folder, with its size and
+// mtime. Built once when the seed starts; an inotify thread applies
+// creates, writes, renames and deletes as they happen.
+
+// Re-read one file's metadata into the index, or drop it if it's gone
+void index_own_file(const char* folder, const char* name) {
+    char file_path[1024];
+    snprintf(file_path, sizeof(file_path), "%s/%s", folder, name);
+    struct stat file_stat;
+    auto present = stat(file_path, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+                   strpbrk(name, "\t\n") == NULL;
+    
+    pthread_rwlock_wrlock(&own_files_lock);
+    if (!present) {
+        own_files.erase(name);
+    } else {
+        auto& file = own_files[name];
+        if (file.size != file_stat.st_size || file.mtime != file_stat.st_mtime) {
+            file.digest.clear();
+        }
+        file.size = file_stat.st_size;
+        file.mtime = file_stat.st_mtime;
+    }
+    pthread_rwlock_unlock(&own_files_lock);
+    invalidate_file_fd(name);
+}
+
+// Replace the whole index with a fresh scan of the folder
+void rebuild_own_file_index(const char* folder) {
+    std::map<std::string, own_file_t> files;
+    DIR *dr = opendir(folder);
+    if (dr != NULL) {
+        struct dirent *de;
+        while ((de = readdir(dr)) != NULL) {
+            // Names that would break the listing formats are left out
+            if (strpbrk(de->d_name, "\t\n") != NULL) {
+                continue;
+            }
+            char file_path[1024];
+            snprintf(file_path, sizeof(file_path), "%s/%s", folder, de->d_name);
+            struct stat file_stat;
+            if (stat(file_path, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+                own_file_t file;
+                file.size = file_stat.st_size;
+                file.mtime = file_stat.st_mtime;
+                files[de->d_name] = file;
+            }
+        }
+        closedir(dr);
+    }
+    
+    pthread_rwlock_wrlock(&own_files_lock);
+    own_files.swap(files);
+    pthread_rwlock_unlock(&own_files_lock);
+    invalidate_file_fd(NULL);
+}
+
+bool lookup_own_file(const char* name, own_file_t* file) {
+    pthread_rwlock_rdlock(&own_files_lock);
+    auto it = own_files.find(name);
+    auto found = it != own_files.end();
+    if (found) {
+        *file = it->second;
+    }
+    pthread_rwlock_unlock(&own_files_lock);
+    return found;
+}
+
+typedef struct {
+    int inotify_fd;
+    std::string folder;
+} own_file_watch_t;
+
+void* own_file_watch_thread(void* arg) {
+    auto watch = (own_file_watch_t*)arg;
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    
+    while (1) {
+        auto bytes = read(watch->inotify_fd, buffer, sizeof(buffer));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            LOG_SERVER(LOG_ERROR, "SEED: inotify read failed, file index is no longer updated");
+            break;
+        }
+        
+        for (char* position = buffer; position < buffer + bytes; ) {
+            auto event = (struct inotify_event*)position;
+            position += sizeof(struct inotify_event) + event->len;
+            
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost; only a full rescan is trustworthy now
+                LOG_SERVER(LOG_WARN, "SEED: inotify queue overflowed, rebuilding file index");
+                rebuild_own_file_index(watch->folder.c_str());
+            } else if (event->len > 0) {
+                index_own_file(watch->folder.c_str(), event->name);
+            }
+        }
+    }
+    close(watch->inotify_fd);
+    delete watch;
+    return NULL;
+}
+
+// Watch our shared folder and build the index. The watch is set up before
+// the first scan so nothing that changes in between is missed.
+void start_own_file_index(const char* folder) {
+    auto inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd >= 0 &&
+        inotify_add_watch(inotify_fd, folder, IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                              IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    
+    rebuild_own_file_index(folder);
+    
+    pthread_rwlock_rdlock(&own_files_lock);
+    auto file_count = own_files.size();
+    pthread_rwlock_unlock(&own_files_lock);
+    LOG_SERVER(LOG_INFO, "SEED: Indexed " + std::to_string(file_count) + " file(s) in " + std::string(folder));
+    
+    if (inotify_fd < 0) {
+        LOG_SERVER(LOG_WARN, "SEED: inotify unavailable (" + std::string(strerror(errno)) + "), file index will not follow changes");
+        return;
+    }
+    auto watch = new own_file_watch_t();
+    watch->inotify_fd = inotify_fd;
+    watch->folder = folder;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, own_file_watch_thread, watch) != 0) {
+        close(inotify_fd);
+        delete watch;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// ===== DESCRIPTOR CACHE =====
+// DOWNLOAD replies borrow a reference-counted descriptor instead of opening
+// the file for every piece. Idle descriptors stay open in LRU order up to
+// fd_cache_capacity; the index drops a file's descriptor whenever inotify
+// reports a change, and one still streaming is closed after its last reply.
+
+// Caller holds fd_cache_mutex
+void unmap_cached_fd(cached_fd_t* cached) {
+    if (cached->map != NULL) {
+        munmap(cached->map, cached->size);
+        cached->map = NULL;
+        fd_cache_stats.mapped_bytes -= cached->size;
+    }
+}
+
+// Caller holds fd_cache_mutex
+void free_cached_fd(cached_fd_t* cached) {
+    unmap_cached_fd(cached);
+    close(cached->fd);
+    delete cached;
+}
+
+// Caller holds fd_cache_mutex
+void drop_cached_fd(cached_fd_t* cached) {
+    fd_cache.erase(cached->name);
+    fd_cache_lru.erase(cached->lru_position);
+    if (cached->refs == 0) {
+        free_cached_fd(cached);
+    } else {
+        cached->stale = true;
+    }
+}
+
+// A referenced descriptor for `name`, opened now if no fresh one is
+// cached. `file` is the index entry it must match. NULL if it can't be opened.
+cached_fd_t* acquire_file_fd(const char* name, const own_file_t& file) {
+    pthread_mutex_lock(&fd_cache_mutex);
+    auto it = fd_cache.find(name);
+    if (it != fd_cache.end()) {
+        auto cached = it->second;
+        if (cached->size == file.size && cached->mtime == file.mtime) {
+            cached->refs++;
+            fd_cache_lru.splice(fd_cache_lru.begin(), fd_cache_lru, cached->lru_position);
+            fd_cache_stats.hits++;
+            pthread_mutex_unlock(&fd_cache_mutex);
+            return cached;
+        }
+        fd_cache_stats.invalidations++;
+        drop_cached_fd(cached);
+    }
+    fd_cache_stats.misses++;
+    pthread_mutex_unlock(&fd_cache_mutex);
+    
+    char file_path[1024];
+    snprintf(file_path, sizeof(file_path), "%s/%s", port_threads[0].folder_path, name);
+    auto fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    auto cached = new cached_fd_t();
+    cached->name = name;
+    cached->fd = fd;
+    cached->size = file.size;
+    cached->mtime = file.mtime;
+    cached->refs = 1;
+    cached->stale = false;
+    cached->map = NULL;
+    cached->next_offset = -1;
+    
+    pthread_mutex_lock(&fd_cache_mutex);
+    it = fd_cache.find(name);
+    if (it != fd_cache.end()) {
+        // Another reactor opened it meanwhile; ours serves just this reply
+        cached->stale = true;
+        pthread_mutex_unlock(&fd_cache_mutex);
+        return cached;
+    }
+    fd_cache_lru.push_front(cached);
+    cached->lru_position = fd_cache_lru.begin();
+    fd_cache[name] = cached;
+    
+    // Close idle descriptors from the cold end; busy ones stay until released
+    auto position = fd_cache_lru.end();
+    while (fd_cache.size() > fd_cache_capacity && position != fd_cache_lru.begin()) {
+        auto victim = *--position;
+        if (victim->refs == 0) {
+            position = fd_cache_lru.erase(position);
+            fd_cache.erase(victim->name);
+            free_cached_fd(victim);
+            fd_cache_stats.evictions++;
+        }
+    }
+    pthread_mutex_unlock(&fd_cache_mutex);
+    return cached;
+}
+
+void release_file_fd(cached_fd_t* cached) {
+    pthread_mutex_lock(&fd_cache_mutex);
+    cached->refs--;
+    if (cached->stale && cached->refs == 0) {
+        free_cached_fd(cached);
+    }
+    pthread_mutex_unlock(&fd_cache_mutex);
+}
+
+// Forget the descriptor for a file that changed (every file if `name` is NULL)
+void invalidate_file_fd(const char* name) {
+    pthread_mutex_lock(&fd_cache_mutex);
+    if (name == NULL) {
+        while (!fd_cache_lru.empty()) {
+            fd_cache_stats.invalidations++;
+            drop_cached_fd(fd_cache_lru.front());
+        }
+    } else {
+        auto it = fd_cache.find(name);
+        if (it != fd_cache.end()) {
+            fd_cache_stats.invalidations++;
+            drop_cached_fd(it->second);
+        }
+    }
+    pthread_mutex_unlock(&fd_cache_mutex);
+}
+
+std::string fd_cache_summary() {
+    pthread_mutex_lock(&fd_cache_mutex);
+    auto lookups = fd_cache_stats.hits + fd_cache_stats.misses;
+    char hit_rate[32];
+    snprintf(hit_rate, sizeof(hit_rate), "%.1f%%", lookups > 0 ? 100.0 * fd_cache_stats.hits / lookups : 0.0);
+    std::string summary = std::to_string(fd_cache_stats.hits) + " hits, " +
+                          std::to_string(fd_cache_stats.misses) + " misses (" + hit_rate + " hit rate), " +
+                          std::to_string(fd_cache_stats.evictions) + " evicted, " +
+                          std::to_string(fd_cache_stats.invalidations) + " invalidated, " +
+                          std::to_string(fd_cache.size()) + " open";
+    if (serve_mmap) {
+        summary += ", " + format_file_size(fd_cache_stats.mapped_bytes) + " mapped, " +
+                   std::to_string(fd_cache_stats.unmaps) + " unmapped under pressure";
+    }
+    pthread_mutex_unlock(&fd_cache_mutex);
+    return summary;
+}
+
+// ===== MEMORY-MAPPED SERVING =====
+// With SEEDAPP_SERVE_MMAP=1 a cached descriptor also maps its whole file,
+// and DOWNLOAD ranges go out of the mapping together with their reply
+// header in one sendmsg(). The mapping lives and dies with the cached
+// descriptor, so the same reference counts keep it valid for every reply
+// still sending from it. Idle mappings are unmapped from the cold end of
+// the LRU when the mapped total passes mmap_budget, or when mmap() itself
+// runs out of memory; such files are served with sendfile() instead.
+// Files must be replaced by rename rather than truncated in place while
+// mapped, as touching a truncated mapping raises SIGBUS.
+
+// Caller holds fd_cache_mutex. Unmap idle mappings until `needed` more
+// bytes fit in the budget; returns false if they still don't.
+bool make_mapping_room(long long needed) {
+    auto position = fd_cache_lru.end();
+    while (fd_cache_stats.mapped_bytes + needed > mmap_budget && position != fd_cache_lru.begin()) {
+        auto victim = *--position;
+        if (victim->refs == 0 && victim->map != NULL) {
+            unmap_cached_fd(victim);
+            fd_cache_stats.unmaps++;
+        }
+    }
+    return fd_cache_stats.mapped_bytes + needed <= mmap_budget;
+}
+
+// Map a cached descriptor's file if it isn't already; false means serve it
+// with sendfile()
+bool map_cached_fd(cached_fd_t* cached) {
+    if (!serve_mmap || cached->size <= 0) {
+        return false;
+    }
+    pthread_mutex_lock(&fd_cache_mutex);
+    if (cached->map == NULL && make_mapping_room(cached->size)) {
+        auto map = mmap(NULL, cached->size, PROT_READ, MAP_SHARED, cached->fd, 0);
+        if (map == MAP_FAILED && errno == ENOMEM && make_mapping_room(mmap_budget)) {
+            map = mmap(NULL, cached->size, PROT_READ, MAP_SHARED, cached->fd, 0);
+        }
+        if (map != MAP_FAILED) {
+            cached->map = (char*)map;
+            fd_cache_stats.mapped_bytes += cached->size;
+        }
+    }
+    auto mapped = cached->map != NULL;
+    pthread_mutex_unlock(&fd_cache_mutex);
+    return mapped;
+}
+
+// Tell the kernel how the mapping is being read: a range that continues
+// where the last one ended reads ahead sequentially, anything else only
+// prefetches the range itself
+void advise_mapping(cached_fd_t* cached, long long offset, long long length) {
+    pthread_mutex_lock(&fd_cache_mutex);
+    auto sequential = offset == cached->next_offset;
+    cached->next_offset = offset + length;
+    pthread_mutex_unlock(&fd_cache_mutex);
+    
+    auto page_size = sysconf(_SC_PAGESIZE);
+    auto start = offset / page_size * page_size;
+    auto end = offset + length;
+    if (sequential) {
+        // Also warm the next range of the same size
+        end = std::min(cached->size, end + length);
+    }
+    madvise(cached->map + start, end - start, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    madvise(cached->map + start, end - start, MADV_WILLNEED);
+}
+
+// Hashes queued files one at a time. A digest is kept only if the file
+// still has the size and mtime it was hashed at; the index clears it
+// whenever inotify reports a change.
+void* own_file_digest_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&digest_mutex);
+        while (digest_queue.empty()) {
+            pthread_cond_wait(&digest_ready, &digest_mutex);
+        }
+        auto name = digest_queue.front();
+        digest_queue.pop_front();
+        pthread_mutex_unlock(&digest_mutex);
+        
+        own_file_t file;
+        if (lookup_own_file(name.c_str(), &file) && file.digest.empty()) {
+            char file_path[1024];
+            snprintf(file_path, sizeof(file_path), "%s/%s", port_threads[0].folder_path, name.c_str());
+            auto digest = hash_file_contents(file_path);
+            
+            struct stat file_stat;
+            auto unchanged = stat(file_path, &file_stat) == 0 && file_stat.st_size == file.size &&
+                             file_stat.st_mtime == file.mtime;
+            pthread_rwlock_wrlock(&own_files_lock);
+            auto it = own_files.find(name);
+            if (unchanged && !digest.empty() && it != own_files.end() &&
+                it->second.size == file.size && it->second.mtime == file.mtime) {
+                it->second.digest = digest;
+            }
+            pthread_rwlock_unlock(&own_files_lock);
+        }
+        
+        pthread_mutex_lock(&digest_mutex);
+        digest_pending.erase(name);
+        pthread_mutex_unlock(&digest_mutex);
+    }
+    return NULL;
+}
+
+void start_digest_thread() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, own_file_digest_thread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+// Ask for one of our files to be hashed; never waits for it
+void request_own_file_digest(const std::string& name) {
+    pthread_once(&digest_thread_once, start_digest_thread);
+    pthread_mutex_lock(&digest_mutex);
+    if (digest_pending.insert(name).second) {
+        digest_queue.push_back(name);
+        pthread_cond_signal(&digest_ready);
+    }
+    pthread_mutex_unlock(&digest_mutex);
+}
+
+// One page of the extended listing for LISTX, covering the files named
+// after `after` ("" for the first page). The page opens with
+// "NEXT <cursor>\n" when more files follow, or "END\n" after the last one,
+// then has one "name\tsize\tmtime\tdigest\n" line per file, with "-" for
+// the digest unless `with_digest` is set and the file has been hashed;
+// files not hashed yet are queued for the digest thread. The cursor is the hex-encoded
+// name of the page's last file, so neither side holds more than one page
+// and files added or removed between pages don't shift the others.
+void get_own_file_details(std::string& response, bool with_digest, const std::string& after) {
+    std::vector<std::pair<std::string, own_file_t> > page;
+    auto more = false;
+    
+    pthread_rwlock_rdlock(&own_files_lock);
+    auto it = after.empty() ? own_files.begin() : own_files.upper_bound(after);
+    for (; it != own_files.end(); ++it) {
+        if (page.size() == (size_t)LIST_PAGE_ENTRIES) {
+            more = true;
+            break;
+        }
+        page.push_back(*it);
+    }
+    pthread_rwlock_unlock(&own_files_lock);
+    
+    response = "END\n";
+    if (more) {
+        static const char HEX[] = "0123456789abcdef";
+        response = "NEXT ";
+        for (auto c : page.back().first) {
+            response += HEX[(unsigned char)c >> 4];
+            response += HEX[(unsigned char)c & 15];
+        }
+        response += "\n";
+    }
+    
+    for (size_t i = 0; i < page.size(); i++) {
+        auto& file = page[i].second;
+        auto& digest = file.digest;
+        if (with_digest && digest.empty()) {
+            request_own_file_digest(page[i].first);
+        }
+        response += page[i].first;
+        response += "\t" + std::to_string(file.size);
+        response += "\t" + std::to_string((long long)file.mtime);
+        response += "\t" + (with_digest && !digest.empty() ? digest : std::string("-")) + "\n";
+    }
+}
+
+// Get files from our own folder (for serving to other ports).
+// Kept for peers that only speak LIST; newer clients page through LISTX.
+void get_own_files(std::string& response) {
+    response.clear();
+    auto file_count = 0;
+    
+    pthread_rwlock_rdlock(&own_files_lock);
+    for (auto it = own_files.begin(); it != own_files.end(); ++it) {
+        response += "[" + std::to_string(++file_count) + "] " + it->first + "\n";
+    }
+    pthread_rwlock_unlock(&own_files_lock);
+}
+
+// Append in-memory bytes to the reply queue, reusing the last segment when
+// it has no file range behind it
+void queue_bytes(connection_t* conn, const char* data, size_t length) {
+    if (conn->out_queue.empty() || conn->out_queue.back().file != NULL) {
+        out_segment_t segment;
+        segment.data_sent = 0;
+        segment.file = NULL;
+        segment.mapped = NULL;
+        segment.file_offset = 0;
+        segment.file_remaining = 0;
+        conn->out_queue.push_back(segment);
+    }
+    conn->out_queue.back().data.append(data, length);
+    conn->out_pending_bytes += length;
+    conn->queued_total += length;
+}
+
+// The reply to the current request is fully queued; time it until it is sent
+void finish_reply(connection_t* conn) {
+    reply_timing_t timing;
+    timing.command = conn->command;
+    timing.started_ns = conn->received_ns;
+    timing.queued_ns = monotonic_ns();
+    timing.end = conn->queued_total;
+    timing.read_ns = 0;
+    conn->timings.push_back(timing);
+    conn->responses_queued++;
+}
+
+// Record every reply whose last byte has now been sent
+void complete_replies(connection_t* conn) {
+    if (conn->timings.empty() || conn->timings.front().end > conn->sent_total) {
+        return;
+    }
+    auto now = monotonic_ns();
+    while (!conn->timings.empty() && conn->timings.front().end <= conn->sent_total) {
+        auto& timing = conn->timings.front();
+        latency_observe(seed_latency_metrics[timing.command], now - timing.started_ns);
+        observe_seed_stage(SEED_STAGE_SEND, now - timing.queued_ns);
+        if (timing.read_ns > 0) {
+            observe_seed_stage(SEED_STAGE_READ, timing.read_ns);
+        }
+        conn->timings.pop_front();
+    }
+}
+
+// Reply header for the binary request being handled
+void queue_wire_header(connection_t* conn, uint8_t status, size_t length) {
+    wire_header_t header;
+    header.magic = WIRE_MAGIC;
+    header.version = WIRE_VERSION;
+    header.opcode = conn->opcode;
+    header.status = status;
+    header.request_id = htole32(conn->request_id);
+    header.length = htole64(length);
+    queue_bytes(conn, (const char*)&header, sizeof(header));
+}
+
+// Queue one reply. Session peers get it framed as "OK <length>\n<payload>" so
+// they can keep several requests in flight; legacy peers get the raw bytes.
+void queue_response(connection_t* conn, const char* data, size_t length) {
+    if (conn->binary_mode) {
+        queue_wire_header(conn, WIRE_OK, length);
+    } else if (conn->session_mode) {
+        char header[64];
+        snprintf(header, sizeof(header), "OK %zu\n", length);
+        queue_bytes(conn, header, strlen(header));
+    }
+    queue_bytes(conn, data, length);
+    finish_reply(conn);
+}
+
+// `status` is only told apart by binary peers; text peers get the message
+void queue_error_status(connection_t* conn, uint8_t status, const char* message) {
+    if (conn->binary_mode) {
+        queue_wire_header(conn, status, strlen(message));
+    } else if (conn->session_mode) {
+        char header[64];
+        snprintf(header, sizeof(header), "ERROR %zu\n", strlen(message));
+        queue_bytes(conn, header, strlen(header));
+    } else {
+        queue_bytes(conn, "ERROR: ", strlen("ERROR: "));
+    }
+    queue_bytes(conn, message, strlen(message));
+    finish_reply(conn);
+}
+
+void queue_error(connection_t* conn, const char* message) {
+    queue_error_status(conn, WIRE_ERROR, message);
+}
+
+// Queue `length` bytes of an open file as the reply. The connection takes
+// over the caller's reference to `file` and releases it once the range has
+// been sent.
+void queue_file_range(connection_t* conn, cached_fd_t* file, off_t offset, size_t length) {
+    if (conn->binary_mode) {
+        queue_wire_header(conn, WIRE_OK, length);
+    } else if (conn->session_mode) {
+        char header[64];
+        snprintf(header, sizeof(header), "OK %zu\n", length);
+        queue_bytes(conn, header, strlen(header));
+    }
+    if (conn->out_queue.empty()) {
+        queue_bytes(conn, "", 0);
+    }
+    auto& segment = conn->out_queue.back();
+    segment.file = file;
+    segment.file_offset = offset;
+    segment.file_remaining = length;
+    segment.mapped = file->map;
+    conn->queued_total += length;
+    finish_reply(conn);
+}
+
+// Room for more replies before the session stops parsing requests
+bool out_queue_has_room(connection_t* conn) {
+    return conn->out_pending_bytes < SESSION_MAX_BACKLOG &&
+           conn->out_queue.size() < SESSION_MAX_QUEUED_REPLIES;
+}
+
+// Queue `length` bytes of `filename` from `offset`, for text and binary
+// DOWNLOAD requests alike
+void serve_download(connection_t* conn, const char* filename, long long offset, long long length) {
+    LOG_SERVER(LOG_TRACE, "SEED PORT " << my_bound_port << ": Download request for '" << filename << "' starting at byte " << offset << " (" << length << " bytes)");
+    
+    // The index says whether we have the file and how big it is; only
+    // files it knows are opened, through the descriptor cache. If the
+    // file shrinks before the range is sent, flush_connection drops the
+    // peer rather than short-send.
+    auto open_started = monotonic_ns();
+    own_file_t file;
+    cached_fd_t* cached = NULL;
+    if (lookup_own_file(filename, &file)) {
+        cached = acquire_file_fd(filename, file);
+    }
+    
+    if (cached != NULL) {
+        long long file_size = file.size;
+        
+        LOG_SERVER(LOG_TRACE, "SEED PORT " << my_bound_port << ": File found (" << file_size << " bytes total)");
+        
+        // Check if offset is valid
+        if (offset >= file_size || length == 0) {
+            LOG_SERVER(LOG_TRACE, "SEED: Offset beyond file size, no more data to send");
+            queue_response(conn, "", 0);
+            release_file_fd(cached);
+            return;
+        }
+        
+        // Clamp the range to the end of the file and stream it with
+        // sendfile(), or from the mapping in mmap mode
+        if (length > file_size - offset) {
+            length = file_size - offset;
+        }
+        if (map_cached_fd(cached)) {
+            advise_mapping(cached, offset, length);
+        }
+        observe_seed_stage(SEED_STAGE_OPEN, monotonic_ns() - open_started);
+        queue_file_range(conn, cached, offset, length);
+        
+        if (offset + length < file_size) {
+            LOG_SERVER(LOG_TRACE, "SEED PORT " << my_bound_port << ": Sending chunk (" << length << " bytes) from position " << offset << " to " << (offset + length - 1));
+        } else {
+            LOG_SERVER(LOG_DEBUG, "SEED PORT " << my_bound_port << ": Sending final chunk (" << length << " bytes) from position " << offset << " to " << (offset + length - 1) << " - FILE COMPLETE!");
+        }
+    } else {
+        LOG_SERVER(LOG_WARN, "SEED PORT " << my_bound_port << ": File '" << filename << "' not found in local storage");
+        
+        // Send error message
+        queue_error_status(conn, WIRE_NOT_FOUND, "File not found");
+    }
+}
+
+// Handle port requests (server side)
+// Runs one parsed command and queues the response on the connection; the
+// reactor that owns the connection takes care of actually sending it.
+void port_request(connection_t* conn, char* buffer) {
+    if (strcmp(buffer, "LIST") == 0) {
+        begin_seed_request(conn, SEED_CMD_LIST);
+        std::string response;
+        get_own_files(response);
+        queue_response(conn, response.data(), response.size()); //sending back to client
+    }
+    else if (strcmp(buffer, "LISTX") == 0 || strncmp(buffer, "LISTX ", 6) == 0) {
+        // Size, mtime and optionally a content digest for every file, so
+        // clients need no FILESIZE round trip per file.
+        // Format: "LISTX [DIGEST] [cursor]", one page per request
+        begin_seed_request(conn, SEED_CMD_LISTX);
+        auto arguments = buffer + 5;
+        auto with_digest = strncmp(arguments, " DIGEST", 7) == 0;
+        if (with_digest) {
+            arguments += 7;
+        }
+        std::string after;
+        if (*arguments == ' ') {
+            arguments++;
+            while (isxdigit((unsigned char)arguments[0]) && isxdigit((unsigned char)arguments[1])) {
+                char hex[3] = {arguments[0], arguments[1], '\0'};
+                after += (char)strtol(hex, NULL, 16);
+                arguments += 2;
+            }
+        }
+        if (*arguments != '\0') {
+            queue_error(conn, "Invalid LISTX request");
+            return;
+        }
+        std::string response;
+        get_own_file_details(response, with_digest, after);
+        queue_response(conn, response.data(), response.size());
+    }
+    else if (strcmp(buffer, "STATS") == 0) {
+        // Every metric in the Prometheus text format, for monitoring
+        begin_seed_request(conn, SEED_CMD_STATS);
+        std::string response;
+        render_metrics(response);
+        queue_response(conn, response.data(), response.size());
+    }
+    else if (strncmp(buffer, "FILESIZE ", 9) == 0) {
+        // Handle FILESIZE command
+        begin_seed_request(conn, SEED_CMD_FILESIZE);
+        char filename[MAX_FILENAME_LENGTH];
+        size_t filename_len = strlen(buffer + 9);
+        if (filename_len < MAX_FILENAME_LENGTH) {
+            strncpy(filename, buffer + 9, MAX_FILENAME_LENGTH - 1);
+            filename[MAX_FILENAME_LENGTH - 1] = '\0';
+        } else {
+            queue_error(conn, "Filename too long");
+            return;
+        }
+        
+        // Remove trailing whitespace/newlines
+        auto newline = strchr(filename, '\n');
+        if (newline) *newline = '\0';
+        
+        // Answer from the file index
+        own_file_t file;
+        if (lookup_own_file(filename, &file)) {
+            // Send size response
+            char size_response[64];
+            snprintf(size_response, sizeof(size_response), "SIZE:%lld", file.size);
+            queue_response(conn, size_response, strlen(size_response));
+            
+            LOG_SERVER(LOG_DEBUG, "SEED PORT " << my_bound_port << ": Client requested file size for '" << filename << "' → Responding with " << file.size << " bytes");
+        } else {
+            queue_error_status(conn, WIRE_NOT_FOUND, "File not found");
+        }
+    }
+    else if (strncmp(buffer, "DOWNLOAD ", 9) == 0) {
+        // Parse DOWNLOAD command - format: "DOWNLOAD filename|offset|length"
+        // Without a length the seed answers with one 32-byte chunk, as older clients expect
+        begin_seed_request(conn, SEED_CMD_DOWNLOAD);
+        char filename[MAX_FILENAME_LENGTH];
+        long long offset = 0;
+        long long length = 32;
+        
+        // Parse filename, offset and length using | delimiter
+        char* delimiter_pos = strchr(buffer + 9, '|');
+        if (delimiter_pos) {
+            // Has offset parameter
+            size_t filename_len = delimiter_pos - (buffer + 9);
+            if (filename_len < MAX_FILENAME_LENGTH) {
+                strncpy(filename, buffer + 9, filename_len);
+                filename[filename_len] = '\0';
+                offset = atoll(delimiter_pos + 1);
+                
+                char* length_pos = strchr(delimiter_pos + 1, '|');
+                if (length_pos) {
+                    length = atoll(length_pos + 1);
+                }
+            } else {
+                queue_error(conn, "Filename too long");
+                return;
+            }
+        } else {
+            // No offset, use original parsing
+            size_t filename_len = strlen(buffer + 9);
+            if (filename_len < MAX_FILENAME_LENGTH) {
+                strncpy(filename, buffer + 9, MAX_FILENAME_LENGTH - 1);
+                filename[MAX_FILENAME_LENGTH - 1] = '\0';
+            } else {
+                queue_error(conn, "Filename too long");
+                return;
+            }
+        }
+        
+        // Remove trailing whitespace/newlines
+        auto newline = strchr(filename, '\n');
+        if (newline) *newline = '\0';
+        
+        if (offset < 0 || length < 0) {
+            queue_error(conn, "Invalid range");
+            return;
+        }
+        
+        serve_download(conn, filename, offset, length);
+    }
+    else {
+        begin_seed_request(conn, SEED_CMD_UNKNOWN);
+    }
+}
+
+// Raise the open file limit so a seed can hold many idle peers at once
+void raise_file_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int set_nonblocking(int fd) {
+    auto flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void close_connection(connection_t* conn) {
+    active_connections--;
+    for (size_t i = 0; i < conn->out_queue.size(); i++) {
+        if (conn->out_queue[i].file != NULL) {
+            release_file_fd(conn->out_queue[i].file);
+        }
+    }
+    close(conn->fd); // closing also removes it from the epoll set
+    conn->state = CONN_CLOSED;
+    delete conn;
+}
+
+// Charge time spent sending file bytes to the reply they belong to: the
+// oldest one not yet fully sent
+void note_file_read(connection_t* conn, long long started_ns) {
+    if (!conn->timings.empty()) {
+        conn->timings.front().read_ns += monotonic_ns() - started_ns;
+    }
+}
+
+// Push as much of the queued response as the socket accepts right now.
+// Returns false if the connection failed and has been closed.
+bool flush_connection(connection_t* conn) {
+    while (!conn->out_queue.empty()) {
+        auto& segment = conn->out_queue.front();
+        ssize_t sent;
+        
+        if (segment.mapped != NULL && segment.file_remaining > 0) {
+            // Header and file range leave together, straight from the mapping
+            struct iovec parts[2];
+            auto part_count = 0;
+            auto header_left = segment.data.size() - segment.data_sent;
+            if (header_left > 0) {
+                parts[part_count].iov_base = (void*)(segment.data.data() + segment.data_sent);
+                parts[part_count].iov_len = header_left;
+                part_count++;
+            }
+            parts[part_count].iov_base = (void*)(segment.mapped + segment.file_offset);
+            parts[part_count].iov_len = segment.file_remaining < SENDFILE_MAX_CHUNK ? segment.file_remaining : SENDFILE_MAX_CHUNK;
+            part_count++;
+            
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = parts;
+            message.msg_iovlen = part_count;
+            auto started = monotonic_ns();
+            sent = sendmsg(conn->fd, &message, MSG_NOSIGNAL);
+            note_file_read(conn, started);
+            if (sent > 0) {
+                metric_add(seed_bytes_sent_metric, sent);
+                conn->sent_total += sent;
+                auto from_header = (size_t)sent < header_left ? (size_t)sent : header_left;
+                segment.data_sent += from_header;
+                conn->out_pending_bytes -= from_header;
+                segment.file_offset += sent - from_header;
+                segment.file_remaining -= sent - from_header;
+                continue;
+            }
+        } else if (segment.data_sent < segment.data.size()) {
+            // A reply header with a file range behind it is held back so
+            // the first sendfile() carries both in one segment
+            auto flags = segment.file_remaining > 0 ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+            sent = send(conn->fd, segment.data.data() + segment.data_sent,
+                        segment.data.size() - segment.data_sent, flags);
+            if (sent > 0) {
+                metric_add(seed_bytes_sent_metric, sent);
+                conn->sent_total += sent;
+                segment.data_sent += sent;
+                conn->out_pending_bytes -= sent;
+                continue;
+            }
+        } else if (segment.file_remaining > 0) {
+            // File bytes go from the page cache to the socket without a user-space copy
+            auto count = segment.file_remaining < SENDFILE_MAX_CHUNK ? segment.file_remaining : SENDFILE_MAX_CHUNK;
+            auto started = monotonic_ns();
+            sent = sendfile(conn->fd, segment.file->fd, &segment.file_offset, count);
+            note_file_read(conn, started);
+            if (sent > 0) {
+                metric_add(seed_bytes_sent_metric, sent);
+                conn->sent_total += sent;
+                segment.file_remaining -= sent;
+                continue;
+            }
+            if (sent == 0) {
+                // File shrank under us; the framed length can no longer be honoured
+                LOG_SERVER(LOG_WARN, "SEED: File truncated while sending, dropping connection");
+                close_connection(conn);
+                return false;
+            }
+        } else {
+            if (segment.file != NULL) {
+                release_file_fd(segment.file);
+            }
+            conn->out_queue.pop_front();
+            continue;
+        }
+        
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break; // wait for EPOLLOUT
+        } else {
+            LOG_SERVER(LOG_ERROR, "SEED: Send failed!");
+            close_connection(conn);
+            return false;
+        }
+    }
+    complete_replies(conn);
+    return true;
+}
+
+// Pull whatever the peer has sent into in_buffer (edge-triggered, so read
+// until the socket runs dry or the buffer is full).
+// Returns the number of bytes read, or -1 if the connection failed.
+ssize_t read_connection(connection_t* conn) {
+    ssize_t total = 0;
+    auto was_empty = conn->in_length == 0;
+    
+    while (!conn->peer_closed && conn->in_length < sizeof(conn->in_buffer) - 1) {
+        auto bytes = recv(conn->fd, conn->in_buffer + conn->in_length,
+                          sizeof(conn->in_buffer) - 1 - conn->in_length, 0);
+        if (bytes > 0) {
+            conn->in_length += bytes;
+            total += bytes;
+        } else if (bytes == 0) {
+            conn->peer_closed = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    conn->in_buffer[conn->in_length] = '\0';
+    if (was_empty && total > 0) {
+        conn->received_ns = monotonic_ns(); // requests are timed from their first byte
+    }
+    return total;
+}
+
+// Remove the first `length` bytes of in_buffer once they have been handled
+void consume_input(connection_t* conn, size_t length) {
+    memmove(conn->in_buffer, conn->in_buffer + length, conn->in_length - length);
+    conn->in_length -= length;
+    conn->in_buffer[conn->in_length] = '\0';
+}
+
+// Answer one binary request. Payloads are read in place from in_buffer.
+// Returns false if the peer broke the protocol and must be dropped.
+bool wire_request(connection_t* conn, const wire_header_t* header, char* payload, size_t length) {
+    conn->opcode = header->opcode;
+    conn->request_id = le32toh(header->request_id);
+    
+    switch (header->opcode) {
+    case WIRE_OP_FILESIZE: {
+        begin_seed_request(conn, SEED_CMD_FILESIZE);
+        std::string filename(payload, length);
+        own_file_t file;
+        if (!lookup_own_file(filename.c_str(), &file)) {
+            queue_error_status(conn, WIRE_NOT_FOUND, "File not found");
+            break;
+        }
+        uint64_t size = htole64(file.size);
+        queue_response(conn, (const char*)&size, sizeof(size));
+        break;
+    }
+    case WIRE_OP_DOWNLOAD: {
+        begin_seed_request(conn, SEED_CMD_DOWNLOAD);
+        if (length < sizeof(wire_download_t) ||
+            length - sizeof(wire_download_t) >= MAX_FILENAME_LENGTH) {
+            queue_error_status(conn, WIRE_BAD_REQUEST, "Invalid DOWNLOAD request");
+            break;
+        }
+        auto range = (const wire_download_t*)payload;
+        long long offset = le64toh(range->offset);
+        long long range_length = le64toh(range->length);
+        if (offset < 0 || range_length < 0) {
+            queue_error_status(conn, WIRE_BAD_REQUEST, "Invalid range");
+            break;
+        }
+        std::string filename(payload + sizeof(wire_download_t), length - sizeof(wire_download_t));
+        serve_download(conn, filename.c_str(), offset, range_length);
+        break;
+    }
+    case WIRE_OP_LIST: {
+        begin_seed_request(conn, SEED_CMD_LISTX);
+        if (length < sizeof(wire_list_t)) {
+            queue_error_status(conn, WIRE_BAD_REQUEST, "Invalid LIST request");
+            break;
+        }
+        auto list = (const wire_list_t*)payload;
+        auto with_digest = (le32toh(list->flags) & WIRE_LIST_DIGEST) != 0;
+        std::string after(payload + sizeof(wire_list_t), length - sizeof(wire_list_t));
+        std::string response;
+        get_own_file_details(response, with_digest, after);
+        queue_response(conn, response.data(), response.size());
+        break;
+    }
+    case WIRE_OP_STATS: {
+        begin_seed_request(conn, SEED_CMD_STATS);
+        std::string response;
+        render_metrics(response);
+        queue_response(conn, response.data(), response.size());
+        break;
+    }
+    case WIRE_OP_HELLO:
+        return false; // only valid as the first message
+    default:
+        begin_seed_request(conn, SEED_CMD_UNKNOWN);
+        queue_error_status(conn, WIRE_UNSUPPORTED, "Unknown opcode");
+        break;
+    }
+    return true;
+}
+
+// Binary counterpart of the session loop below: the first frame must be a
+// HELLO, every later one a request. Frames are handled straight out of
+// in_buffer without copying.
+int process_wire_requests(connection_t* conn) {
+    auto handled = 0;
+    size_t frame_start = 0;
+    
+    while (out_queue_has_room(conn) && !conn->close_after_flush) {
+        auto available = conn->in_length - frame_start;
+        if (available < sizeof(wire_header_t)) {
+            break;
+        }
+        auto header = (const wire_header_t*)(conn->in_buffer + frame_start);
+        auto length = le64toh(header->length);
+        if (header->magic != WIRE_MAGIC || length > WIRE_MAX_REQUEST) {
+            return -1;
+        }
+        if (available < sizeof(wire_header_t) + length) {
+            break;
+        }
+        auto payload = conn->in_buffer + frame_start + sizeof(wire_header_t);
+        
+        if (!conn->binary_mode) {
+            // Version negotiation: pick the newest version both sides speak
+            conn->opcode = header->opcode;
+            conn->request_id = le32toh(header->request_id);
+            conn->binary_mode = true;
+            if (header->opcode != WIRE_OP_HELLO || length < sizeof(wire_hello_t)) {
+                queue_error_status(conn, WIRE_BAD_REQUEST, "Expected HELLO");
+                conn->close_after_flush = true;
+            } else {
+                auto offer = (const wire_hello_t*)payload;
+                if (offer->min_version > WIRE_VERSION || offer->max_version < WIRE_VERSION) {
+                    queue_error_status(conn, WIRE_UNSUPPORTED, "Unsupported protocol version");
+                    conn->close_after_flush = true;
+                } else {
+                    wire_hello_t reply;
+                    reply.min_version = WIRE_VERSION;
+                    reply.max_version = WIRE_VERSION;
+                    reply.reserved = 0;
+                    reply.features = htole32(le32toh(offer->features) & WIRE_FEATURES);
+                    begin_seed_request(conn, SEED_CMD_SESSION);
+                    queue_response(conn, (const char*)&reply, sizeof(reply));
+                }
+            }
+        } else {
+            if (header->version != WIRE_VERSION) {
+                return -1;
+            }
+            if (!wire_request(conn, header, payload, length)) {
+                return -1;
+            }
+        }
+        frame_start += sizeof(wire_header_t) + length;
+        handled++;
+    }
+    consume_input(conn, frame_start);
+    
+    if (conn->peer_closed && handled == 0 && conn->in_length > 0 && conn->out_queue.empty()) {
+        return -1; // a truncated frame that will never complete
+    }
+    return handled;
+}
+
+// Run every complete request sitting in in_buffer.
+// Binary peers open with a WIRE_MAGIC byte and are handed to
+// process_wire_requests.
+// Legacy peers send one unterminated command and wait for the socket to close.
+// Session peers open with "SESSION\n" and then send newline-terminated
+// requests back to back; each gets a framed reply, in order, without the
+// seed waiting for the client in between.
+// Returns the number of requests handled, or -1 if the peer must be dropped.
+int process_requests(connection_t* conn) {
+    static const char SESSION_HELLO[] = "SESSION\n";
+    auto handled = 0;
+    
+    if (conn->binary_mode ||
+        (!conn->session_mode && conn->in_length > 0 && (uint8_t)conn->in_buffer[0] == WIRE_MAGIC)) {
+        return process_wire_requests(conn);
+    }
+    if (!conn->session_mode) {
+        if (conn->in_length == 0 || conn->close_after_flush) {
+            return 0;
+        }
+        if (strncmp(conn->in_buffer, SESSION_HELLO, conn->in_length < strlen(SESSION_HELLO) ? conn->in_length : strlen(SESSION_HELLO)) == 0) {
+            if (conn->in_length < strlen(SESSION_HELLO)) {
+                return conn->peer_closed ? -1 : 0; // rest of the hello is still on its way
+            }
+            consume_input(conn, strlen(SESSION_HELLO));
+            begin_seed_request(conn, SEED_CMD_SESSION);
+            conn->session_mode = true;
+            queue_response(conn, "", 0);
+            handled++;
+        } else {
+            // One-shot request: answer it and close once the reply is out
+            auto newline = strchr(conn->in_buffer, '\n');
+            if (newline) *newline = '\0';
+            port_request(conn, conn->in_buffer);
+            conn->in_length = 0;
+            conn->close_after_flush = true;
+            return 1;
+        }
+    }
+    
+    size_t line_start = 0;
+    while (out_queue_has_room(conn)) {
+        auto newline = (char*)memchr(conn->in_buffer + line_start, '\n', conn->in_length - line_start);
+        if (newline == NULL) {
+            break;
+        }
+        *newline = '\0';
+        if (newline > conn->in_buffer + line_start && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        
+        auto before = conn->responses_queued;
+        port_request(conn, conn->in_buffer + line_start);
+        if (conn->responses_queued == before) {
+            queue_error(conn, "Unknown command");
+        }
+        line_start = newline - conn->in_buffer + 1;
+        handled++;
+    }
+    consume_input(conn, line_start);
+    
+    if (conn->in_length == sizeof(conn->in_buffer) - 1 && handled == 0 &&
+        conn->out_queue.empty()) {
+        return -1; // a single request that doesn't fit the buffer
+    }
+    return handled;
+}
+
+// Drive a connection as far as it can go without blocking: read, answer
+// every complete request, flush, and repeat while that keeps making progress.
+void service_connection(connection_t* conn) {
+    while (1) {
+        auto bytes = read_connection(conn);
+        if (bytes < 0) {
+            close_connection(conn);
+            return;
+        }
+        
+        auto handled = process_requests(conn);
+        if (handled < 0) {
+            close_connection(conn);
+            return;
+        }
+        if (!flush_connection(conn)) {
+            return;
+        }
+        
+        if (!conn->out_queue.empty()) {
+            conn->state = CONN_WRITING; // resumed on EPOLLOUT
+            return;
+        }
+        conn->state = CONN_READING;
+        
+        if (conn->close_after_flush || (conn->peer_closed && handled == 0)) {
+            close_connection(conn);
+            return;
+        }
+        if (bytes == 0 && handled == 0) {
+            return; // nothing more until the next event
+        }
+    }
+}
+
+// ===== ACCEPT QUEUE =====
+
+bool fd_queue_init(fd_queue_t* queue, size_t capacity) {
+    auto size = (size_t)2;
+    while (size < capacity) {
+        size *= 2;
+    }
+    queue->cells = new fd_queue_cell_t[size];
+    for (size_t i = 0; i < size; i++) {
+        queue->cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    queue->mask = size - 1;
+    queue->enqueue_position.store(0, std::memory_order_relaxed);
+    queue->dequeue_position.store(0, std::memory_order_relaxed);
+    return true;
+}
+
+// False if the queue is full
+bool fd_queue_push(fd_queue_t* queue, int fd, long long queued_ns) {
+    auto position = queue->enqueue_position.load(std::memory_order_relaxed);
+    while (1) {
+        auto cell = &queue->cells[position & queue->mask];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (queue->enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                cell->fd = fd;
+                cell->queued_ns = queued_ns;
+                cell->sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = queue->enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// False if the queue is empty
+bool fd_queue_pop(fd_queue_t* queue, int* fd, long long* queued_ns) {
+    auto position = queue->dequeue_position.load(std::memory_order_relaxed);
+    while (1) {
+        auto cell = &queue->cells[position & queue->mask];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0) {
+            if (queue->dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                *fd = cell->fd;
+                *queued_ns = cell->queued_ns;
+                cell->sequence.store(position + queue->mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = queue->dequeue_position.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// Turn a peer away. Nothing has been read yet, so the reply can't match the
+// peer's protocol; it is one "ERROR:" line, which one-shot clients already
+// treat as a failure and our session and wire clients recognise as busy.
+void reject_busy(acceptor_t* acceptor, int client_filehandle) {
+    send(client_filehandle, BUSY_REPLY, strlen(BUSY_REPLY), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(client_filehandle);
+    acceptor->rejected++;
+}
+
+// Accept peers and queue them for the event loops, rejecting any beyond
+// max_connections or a full queue
+void* acceptor_thread(void* arg) {
+    auto acceptor = (acceptor_t*)arg;
+    
+    while (1) {
+        auto client_filehandle = accept4(acceptor->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_filehandle < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            LOG_SERVER(LOG_ERROR, "SEED: accept failed: " + std::string(strerror(errno)));
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                usleep(10000); // out of descriptors or memory; let some connections finish
+                continue;
+            }
+            break;
+        }
+        
+        if (active_connections.load() >= max_connections) {
+            reject_busy(acceptor, client_filehandle);
+            continue;
+        }
+        set_no_delay(client_filehandle);
+        active_connections++;
+        if (!fd_queue_push(&acceptor->queue, client_filehandle, monotonic_ns())) {
+            active_connections--;
+            reject_busy(acceptor, client_filehandle);
+            continue;
+        }
+        acceptor->accepted++;
+        uint64_t one = 1;
+        if (write(acceptor->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG_SERVER(LOG_ERROR, "SEED: eventfd write failed: " + std::string(strerror(errno)));
+        }
+    }
+    return NULL;
+}
+
+// Take every queued peer into this reactor's epoll set
+void adopt_connections(reactor_t* reactor) {
+    auto acceptor = reactor->acceptor;
+    uint64_t count;
+    if (read(acceptor->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOG_SERVER(LOG_ERROR, "SEED: eventfd read failed: " + std::string(strerror(errno)));
+    }
+    
+    int client_filehandle;
+    long long queued_ns;
+    while (fd_queue_pop(&acceptor->queue, &client_filehandle, &queued_ns)) {
+        auto now = monotonic_ns();
+        observe_seed_stage(SEED_STAGE_QUEUE, now - queued_ns);
+        auto conn = new connection_t();
+        conn->fd = client_filehandle;
+        conn->state = CONN_READING;
+        conn->session_mode = false;
+        conn->binary_mode = false;
+        conn->peer_closed = false;
+        conn->close_after_flush = false;
+        conn->in_length = 0;
+        conn->out_pending_bytes = 0;
+        conn->responses_queued = 0;
+        conn->command = SEED_CMD_UNKNOWN;
+        conn->received_ns = now;
+        conn->queued_total = 0;
+        conn->sent_total = 0;
+        
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_filehandle, &event) < 0) {
+            LOG_SERVER(LOG_ERROR, "SEED: epoll_ctl failed: " + std::string(strerror(errno)));
+            close_connection(conn);
+        }
+    }
+}
+
+// Event loop thread: owns every connection it adopted until it is closed
+void* reactor_thread(void* arg) {
+    auto reactor = (reactor_t*)arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    
+    while (1) {
+        auto ready = epoll_wait(reactor->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_SERVER(LOG_ERROR, "SEED: epoll_wait failed: " + std::string(strerror(errno)));
+            break;
+        }
+        
+        for (auto i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL) {
+                adopt_connections(reactor);
+                continue;
+            }
+            
+            auto conn = (connection_t*)events[i].data.ptr;
+            auto flags = events[i].events;
+            
+            if (flags & EPOLLERR) {
+                close_connection(conn);
+            } else if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP) ||
+                       (conn->state == CONN_WRITING && (flags & EPOLLOUT))) {
+                service_connection(conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Start a detached server thread with the small server stack, pinned to
+// `cpu` unless it is -1
+int start_server_thread(pthread_t* thread, void* (*routine)(void*), void* arg, int cpu) {
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, SERVER_THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attributes, sizeof(cpus), &cpus);
+    }
+    auto result = pthread_create(thread, &attributes, routine, arg);
+    pthread_attr_destroy(&attributes);
+    return result;
+}
+
+// Start the acceptors for `listen_fds` and the event loops they feed.
+// One listening socket is shared by a pool of server_threads reactors, which
+// take turns adopting its peers. With several SO_REUSEPORT sockets each gets
+// exactly one reactor, and the pair is pinned to its own core so the
+// kernel's spread of connections across sockets is also a spread across cores.
+int start_reactors(const std::vector<int>& listen_fds) {
+    auto pinned = listen_fds.size() > 1;
+    
+    // Pin round-robin over the cores we are allowed to run on
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    if (pinned && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (auto cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    
+    for (size_t i = 0; i < listen_fds.size(); i++) {
+        auto acceptor = new acceptor_t();
+        acceptor->index = i;
+        acceptor->listen_fd = listen_fds[i];
+        acceptor->cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        fd_queue_init(&acceptor->queue, accept_queue_depth);
+        acceptor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (acceptor->event_fd < 0) {
+            return -1;
+        }
+        acceptors.push_back(acceptor);
+    }
+    
+    reactors.resize(pinned ? listen_fds.size() : server_threads);
+    for (size_t i = 0; i < reactors.size(); i++) {
+        reactors[i].index = i;
+        reactors[i].acceptor = acceptors[pinned ? i : 0];
+        reactors[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactors[i].epoll_fd < 0) {
+            return -1;
+        }
+        
+        // Reactors wait on their acceptor's eventfd; EPOLLEXCLUSIVE wakes
+        // only one of those sharing it, which adopts everything queued so far
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, reactors[i].acceptor->event_fd, &event) < 0) {
+            return -1;
+        }
+        
+        if (start_server_thread(&reactors[i].thread_id, reactor_thread, &reactors[i], reactors[i].acceptor->cpu) != 0) {
+            return -1;
+        }
+    }
+    
+    for (size_t i = 0; i < acceptors.size(); i++) {
+        if (start_server_thread(&acceptors[i]->thread_id, acceptor_thread, acceptors[i], acceptors[i]->cpu) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+std::string server_summary() {
+    long long accepted = 0, rejected = 0;
+    for (size_t i = 0; i < acceptors.size(); i++) {
+        accepted += acceptors[i]->accepted.load();
+        rejected += acceptors[i]->rejected.load();
+    }
+    return std::to_string(active_connections.load()) + " connected, " +
+           std::to_string(accepted) + " accepted, " +
+           std::to_string(rejected) + " rejected busy (" +
+           std::to_string(acceptors.size()) + " acceptor(s), " + std::to_string(reactors.size()) + " threads, " +
+           "backlog " + std::to_string(listen_backlog) + ", limit " + std::to_string(max_connections) + ")";
+}
+
+// Per-acceptor counts, to check that SO_REUSEPORT spreads peers evenly
+void show_acceptor_stats() {
+    if (acceptors.size() < 2) {
+        return;
+    }
+    for (size_t i = 0; i < acceptors.size(); i++) {
+        std::cout << "  Acceptor " << i << " (cpu " << acceptors[i]->cpu << "): "
+                  << acceptors[i]->accepted.load() << " accepted, "
+                  << acceptors[i]->rejected.load() << " rejected busy" << std::endl;
+    }
+}
+
+void port_server() {
+    std::cout << "Finding available ports...";
+    
+    for (auto i = 0; i < MAX_PORTS; i++) {
+        auto port = PORTS[i];
+        
+        //if (is_port_available(port)) {
+            auto reuse_port = acceptor_count > 1;
+            if (reuse_port) {
+                port_claim_fd = claim_port(port);
+                if (port_claim_fd < 0) {
+                    continue;
+                }
+            }
+            auto sock = bind_and_listen(port, reuse_port);
+            if (sock < 0 && reuse_port) {
+                close(port_claim_fd);
+                port_claim_fd = -1;
+            }
+            if (sock >= 0) {
+                my_bound_port = port;
+                
+                // The rest of the SO_REUSEPORT sockets join the first one
+                std::vector<int> listen_fds(1, sock);
+                for (auto j = 1; j < acceptor_count; j++) {
+                    auto extra = bind_and_listen(port, true);
+                    if (extra < 0) {
+                        LOG_SERVER(LOG_WARN, "SEED: could only open " + std::to_string(j) + " SO_REUSEPORT socket(s): " + std::string(strerror(errno)));
+                        break;
+                    }
+                    listen_fds.push_back(extra);
+                }
+                
+                // Set up port thread data
+                port_threads[0].port = port;
+                port_threads[0].folder_id = i + 1;
+                port_threads[0].thread_index = 0;
+                port_threads[0].socket_FileHandle = sock;
+                port_threads[0].is_bound = 1;
+                snprintf(port_threads[0].folder_path, sizeof(port_threads[0].folder_path), 
+                         "files/seed%d/%d", port_threads[0].folder_id, port_threads[0].folder_id);
+                
+                bound_port_count = 1;
+                
+                std::cout << " Found port " << port << "." << std::endl;
+                std::cout << "Listening at port " << port << "." << std::endl;
+                
+                // Index what we share before the first request can arrive
+                start_own_file_index(port_threads[0].folder_path);
+                
+                // Start the event loops that handle port requests
+                raise_file_limit();
+                if (start_reactors(listen_fds) < 0) {
+                    LOG_SERVER(LOG_ERROR, "Error: Could not start server event loops");
+                    std::cout << "Error: Could not start server event loops." << std::endl;
+                }
+                
+                return;
+            }
+        //}
+    }
+    
+    std::cout << " No available ports found." << std::endl;
+}
+
+void download_file(){
+    
+     // Check if we have any files to download
+     auto catalog = current_catalog();
+     auto file_count = catalog_count(catalog.get());
+     if (file_count == 0) {
+         LOG_CLIENT(LOG_INFO, "No files available to download. Please list files first (option 1).");
+         std::cout << "No files available to download. Please list files first (option 1)." << std::endl;
+         return;
+     }
+     
+     // Show available files
+     std::cout << "Available files for download:" << std::endl;
+     catalog_entry_t entry;
+     for (auto i = 1; i <= file_count; i++) {
+         if (catalog_entry_at(catalog.get(), i, &entry)) {
+             std::cout << "[" << i << "] " << format_catalog_entry(entry) << std::endl;
+         }
+     }
+     
+     // Get user's choice: one or more IDs separated by commas, each
+     // optionally followed by :priority (e.g. "2,5:10")
+     std::cout << "\nEnter file ID(s), e.g. 1 or 1,3 or 2:5 for priority 5: ";
+     std::string selection;
+     std::cin >> selection;
+     
+     std::vector<std::string> filenames;
+     std::vector<int> file_choices;
+     std::vector<int> priorities;
+     std::stringstream entries(selection);
+     std::string choice;
+     while (std::getline(entries, choice, ',')) {
+         auto file_choice = 0;
+         auto priority = 0;
+         if (sscanf(choice.c_str(), "%d:%d", &file_choice, &priority) < 1) {
+             file_choice = 0;
+         }
+         
+         // Validate choice
+         if (!catalog_entry_at(catalog.get(), file_choice, &entry)) {
+             LOG_CLIENT(LOG_INFO, "Locating seeders... Failed - No seeders for file ID " + std::to_string(file_choice));
+             std::cout << "Locating seeders... Failed" << std::endl;
+             std::cout << "No seeders for file ID " << file_choice << "." <<std::endl;
+             continue;
+         }
+         filenames.push_back(entry.filename);
+         file_choices.push_back(file_choice);
+         priorities.push_back(priority);
+     }
+     
+     for (size_t i = 0; i < filenames.size(); i++) {
+         queue_file_download(filenames[i].c_str(), file_choices[i], priorities[i]);
+     }
+}
+
+// Locate seeds for one chosen file and hand it to the download manager
+void queue_file_download(const char* filename, int file_choice, int priority) {
+     // A fresh catalog entry already says who has the file and how big it
+     // is; a stale one is still used, with one size check, while the
+     // catalog is refreshed in the background
+     auto catalog = current_catalog();
+     catalog_entry_t entry;
+     std::vector<int> available_seeds;
+     long long expected_size = -1;
+     if (catalog_lookup(catalog.get(), filename, &entry) && !entry.seeds.empty()) {
+         available_seeds = entry.seeds;
+         if (catalog_entry_is_fresh(entry)) {
+             expected_size = entry.size;
+             LOG_CLIENT(LOG_INFO, "Using cached seeds for '" + std::string(filename) + "': " + format_seed_ports(entry.seeds));
+         } else {
+             LOG_CLIENT(LOG_INFO, "Cached seeds for '" + std::string(filename) + "' are stale, refreshing in the background");
+             refresh_catalog_async();
+         }
+     } else {
+         LOG_CLIENT(LOG_INFO, "Scanning all seeds for file '" + std::string(filename) + "'...");
+         std::cout << "Scanning all seeds for file '" << filename << "'..." << std::endl;
+         
+         // Scan all seeds for this file
+         expected_size = scan_seeds_for_file(filename, available_seeds);
+     }
+     
+     if (available_seeds.empty()) {
+         LOG_CLIENT(LOG_INFO, "No seeds found with file '" + std::string(filename) + "'. Cannot download.");
+         std::cout << "No seeds found with file '" << filename << "'. Cannot download." << std::endl;
+         return;
+     }
+     
+     // Get expected file size from one of the seeds unless the catalog knows it
+     if (expected_size < 0) {
+         expected_size = get_file_size_from_seed(available_seeds[0], filename);
+         if (expected_size >= 0) {
+             catalog_set_size(catalog.get(), filename, expected_size);
+         }
+     }
+     if (expected_size <= 0) {
+         LOG_CLIENT(LOG_WARN, "Could not determine file size. Download may fail.");
+         std::cout << "Could not determine file size. Download may fail." << std::endl;
+     } else {
+         LOG_CLIENT(LOG_INFO, "Expected file size: " + std::to_string(expected_size) + " bytes");
+         std::cout << "Expected file size: " << expected_size << " bytes" << std::endl;
+         
+         // Check if file already exists locally with correct size
+         char existing_path[1024];
+         if (check_file_already_exists(filename, expected_size, existing_path, sizeof(existing_path))) {
+             LOG_CLIENT(LOG_INFO, "File [" + std::to_string(file_choice) + "] " + std::string(filename) + " already exists");
+             std::cout << " File [" << file_choice << "] " << filename << " already exists" << std::endl;
+             return;
+         } else {
+             LOG_CLIENT(LOG_INFO, "File not found locally or size mismatch. Starting download...");
+             std::cout << "File not found locally or size mismatch. Starting download..." << std::endl;
+         }
+     }
+     
+     auto id = submit_download(filename, available_seeds, expected_size, priority);
+     if (id < 0) {
+         std::cout << "'" << filename << "' is already queued or downloading." << std::endl;
+         LOG_CLIENT(LOG_INFO, "Download request rejected - '" + std::string(filename) + "' already queued or downloading");
+         return;
+     }
+     
+     std::cout << "Download #" << id << " queued for file: " << filename
+               << " (priority " << priority << ")" << std::endl;
+     std::cout << "You can continue using the menu while the download progresses." << std::endl;
+     LOG_CLIENT(LOG_INFO, "Download #" + std::to_string(id) + " queued for file: " + std::string(filename) + " with priority " + std::to_string(priority));
+}
+
+// listing_entry_fn for scan_seeds_for_file: note the seeds holding the file
+void match_listed_file(int port, listing_entry_t* listed, void* arg) {
+    auto search = (file_search_t*)arg;
+    if (listed->filename != search->filename) {
+        return;
+    }
+    // Seeds holding a copy of a different size don't count
+    if (listed->size >= 0 && search->size >= 0 && listed->size != search->size) {
+        LOG_CLIENT(LOG_WARN, "Port " + std::to_string(port) + " has '" + listed->filename + "' with size " + std::to_string(listed->size) + " instead of " + std::to_string(search->size) + ", skipping");
+        return;
+    }
+    if (listed->size >= 0) {
+        search->size = listed->size;
+    }
+    search->ports.push_back(port);
+}
+
+// Scan every other seed for the same file, collecting the ports that hold it.
+// Returns the file's size if the seeds' listings carried it, otherwise -1.
+long long scan_seeds_for_file(const char* filename, std::vector<int>& available_seeds) {
+    available_seeds.clear();
+    
+    // Ask all other ports at once (excluding current bound port)
+    LOG_CLIENT(LOG_INFO, "Scanning seeds for file '" + std::string(filename) + "'...");
+    std::vector<scan_result_t> results;
+    file_search_t search;
+    search.filename = filename;
+    search.size = -1;
+    scan_listings(results, match_listed_file, &search);
+    auto file_size = search.size;
+    
+    for (size_t i = 0; i < results.size(); i++) {
+        auto port = results[i].port;
+        std::cout << "Scanning seed at port " << port << "... ";
+        
+        if (results[i].result != SEED_NOT_RUNNING) {
+            if (results[i].result == SEED_CALL_OK && results[i].ok) {
+                // Check if filename was in this seed's file list
+                if (std::find(search.ports.begin(), search.ports.end(), port) != search.ports.end()) {
+                    LOG_CLIENT(LOG_DEBUG, "FOUND on seed " + std::to_string(port));
+                    std::cout << "found" << std::endl;
+                    available_seeds.push_back(port);
+                } else {
+                    LOG_CLIENT(LOG_DEBUG, "not found on seed " + std::to_string(port));
+                    std::cout << "not found" << std::endl;
+                }
+            } else {
+                LOG_CLIENT(LOG_DEBUG, "no response from port " + std::to_string(port));
+                std::cout << "no response" << std::endl;
+            }
+        } else {
+            LOG_CLIENT(LOG_DEBUG, "port " + std::to_string(port) + " not running");
+            std::cout << "not running" << std::endl;
+        }
+    }
+    
+    LOG_CLIENT(LOG_INFO, "Found " + std::to_string(available_seeds.size()) + " seed(s) with file '" + std::string(filename) + "'");
+    std::cout << "Found " << available_seeds.size() << " seed(s) with file '" << filename << "'" << std::endl;
+    
+    // Remember the answer so the next request for this file skips the scan
+    if (!available_seeds.empty()) {
+        catalog_set_seeds(current_catalog().get(), filename, available_seeds);
+        if (file_size >= 0) {
+            catalog_set_size(current_catalog().get(), filename, file_size);
+        }
+    }
+    return file_size;
+}
+
+// ===== CLIENT SIDE SESSIONS =====
+// A session is one connection to a seed that carries many requests. Replies
+// come back framed ("OK <length>\n" or "ERROR <length>\n" plus payload) in
+// the order the requests were sent, so several can be in flight at once.
+
+// A stopped or wedged seed must not hang the caller forever
+void set_seed_timeouts(int sock) {
+    struct timeval timeout;
+    timeout.tv_sec = SEED_IO_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Connect to a seed on localhost; returns the socket or -1
+int connect_to_seed(int port) {
+    auto sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    set_seed_timeouts(sock);
+    set_no_delay(sock);
+    return sock;
+}
+
+bool send_all(int sock, const char* data, size_t length) {
+    while (length > 0) {
+        auto sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Refill the session's read buffer; returns false if the seed went away
+bool fill_session_buffer(seed_session_t* session) {
+    if (session->start > 0) {
+        memmove(session->buffer, session->buffer + session->start, session->end - session->start);
+        session->end -= session->start;
+        session->start = 0;
+    }
+    while (1) {
+        auto bytes = recv(session->fd, session->buffer + session->end, sizeof(session->buffer) - session->end, 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        session->end += bytes;
+        return true;
+    }
+}
+
+// Queue a request on the session without waiting for its reply
+bool send_session_request(seed_session_t* session, const char* command) {
+    std::string line(command);
+    line += '\n';
+    if (!send_all(session->fd, line.data(), line.size())) {
+        return false;
+    }
+    session->pending_replies++;
+    return true;
+}
+
+// Queue a binary request without waiting for its reply
+bool send_wire_request(seed_session_t* session, uint8_t opcode, const std::string& payload) {
+    wire_header_t header;
+    header.magic = WIRE_MAGIC;
+    header.version = WIRE_VERSION;
+    header.opcode = opcode;
+    header.status = 0;
+    header.request_id = htole32(session->next_request_id);
+    header.length = htole64(payload.size());
+    
+    std::string frame((const char*)&header, sizeof(header));
+    frame += payload;
+    if (!send_all(session->fd, frame.data(), frame.size())) {
+        return false;
+    }
+    session->next_request_id++;
+    session->pending_replies++;
+    return true;
+}
+
+// Ask for one range of a file in whichever protocol the session speaks
+bool send_download_request(seed_session_t* session, const char* filename, long long offset, long long length) {
+    if (session->binary) {
+        wire_download_t range;
+        range.offset = htole64(offset);
+        range.length = htole64(length);
+        std::string payload((const char*)&range, sizeof(range));
+        payload += filename;
+        return send_wire_request(session, WIRE_OP_DOWNLOAD, payload);
+    }
+    char request[512];
+    snprintf(request, sizeof(request), "DOWNLOAD %s|%lld|%lld", filename, offset, length);
+    return send_session_request(session, request);
+}
+
+// Fixed header of the next binary reply
+bool read_wire_header(seed_session_t* session, bool* ok, size_t* length) {
+    while (session->end - session->start < sizeof(wire_header_t)) {
+        if (!fill_session_buffer(session)) {
+            return false;
+        }
+    }
+    wire_header_t header;
+    memcpy(&header, session->buffer + session->start, sizeof(header));
+    if (header.magic != WIRE_MAGIC || le32toh(header.request_id) != session->next_reply_id) {
+        return false;
+    }
+    *ok = header.status == WIRE_OK;
+    *length = le64toh(header.length);
+    session->start += sizeof(header);
+    session->next_reply_id++;
+    session->pending_replies--;
+    return true;
+}
+
+// Read the header of the next framed reply
+bool read_session_header(seed_session_t* session, bool* ok, size_t* length) {
+    if (session->binary) {
+        return read_wire_header(session, ok, length);
+    }
+    char* newline;
+    while ((newline = (char*)memchr(session->buffer + session->start, '\n', session->end - session->start)) == NULL) {
+        if (session->end - session->start == sizeof(session->buffer) || !fill_session_buffer(session)) {
+            return false;
+        }
+    }
+    *newline = '\0';
+    
+    auto header = session->buffer + session->start;
+    if ((size_t)(newline - header) == strlen(BUSY_REPLY) - 1 && strncmp(header, BUSY_REPLY, newline - header) == 0) {
+        *ok = false;
+        *length = 0;
+        session->busy = true;
+    } else if (strncmp(header, "OK ", 3) == 0) {
+        *ok = true;
+        *length = strtoull(header + 3, NULL, 10);
+    } else if (strncmp(header, "ERROR ", 6) == 0) {
+        *ok = false;
+        *length = strtoull(header + 6, NULL, 10);
+    } else {
+        return false;
+    }
+    session->start = newline - session->buffer + 1;
+    session->pending_replies--;
+    return true;
+}
+
+// Payload of the reply whose header was just read: whatever is buffered
+// first, then straight from the socket into the caller's memory
+bool read_session_payload(seed_session_t* session, char* payload, size_t length) {
+    size_t received = session->end - session->start;
+    if (received > length) {
+        received = length;
+    }
+    memcpy(payload, session->buffer + session->start, received);
+    session->start += received;
+    
+    while (received < length) {
+        auto bytes = recv(session->fd, payload + received, length - received, 0);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        received += bytes;
+    }
+    return true;
+}
+
+// Read the next framed reply. `ok` tells OK from ERROR; the payload is
+// copied into `payload`. Returns false if the session broke.
+bool read_session_response(seed_session_t* session, bool* ok, std::string& payload) {
+    size_t length = 0;
+    if (!read_session_header(session, ok, &length)) {
+        return false;
+    }
+    payload.resize(length);
+    return length == 0 || read_session_payload(session, &payload[0], length);
+}
+
+void close_seed_session(seed_session_t* session) {
+    if (session) {
+        close(session->fd);
+        delete session;
+    }
+}
+
+// Offer the seed the binary protocol. Only a reply that doesn't start with
+// the wire magic proves the seed speaks text alone; a timeout or reset
+// says nothing about the protocol and is just a failed connection.
+wire_negotiation_t negotiate_wire_protocol(seed_session_t* session) {
+    wire_hello_t hello;
+    hello.min_version = WIRE_VERSION;
+    hello.max_version = WIRE_VERSION;
+    hello.reserved = 0;
+    hello.features = htole32(WIRE_FEATURES);
+    session->binary = true;
+    if (!send_wire_request(session, WIRE_OP_HELLO, std::string((const char*)&hello, sizeof(hello)))) {
+        return WIRE_FAILED;
+    }
+    
+    // Older seeds take the hello for a one-shot command they don't know
+    // and hang up without a word; errno stays 0 on an orderly close
+    errno = 0;
+    if (session->start == session->end && !fill_session_buffer(session)) {
+        return errno == 0 ? WIRE_HUNG_UP : WIRE_FAILED;
+    }
+    bool ok = false;
+    std::string payload;
+    // A busy seed answers before reading the hello, so its reply is text
+    if ((uint8_t)session->buffer[session->start] != WIRE_MAGIC) {
+        session->binary = false;
+        if (read_session_response(session, &ok, payload) && session->busy) {
+            LOG_CLIENT(LOG_WARN, "Port " + std::to_string(session->port) + " is busy, leaving it to other seeds");
+            return WIRE_FAILED;
+        }
+        return WIRE_TEXT_ONLY;
+    }
+    if (!read_session_response(session, &ok, payload)) {
+        return WIRE_FAILED;
+    }
+    if (!ok || payload.size() < sizeof(wire_hello_t)) {
+        return WIRE_TEXT_ONLY; // no version in common
+    }
+    wire_hello_t reply;
+    memcpy(&reply, payload.data(), sizeof(reply));
+    session->features = le32toh(reply.features);
+    return WIRE_NEGOTIATED;
+}
+
+// Open a session with a seed; returns NULL if it is not running or
+// doesn't understand sessions. A `binary` session is negotiated in the
+// wire protocol when the seed supports it and falls back to text if not.
+seed_session_t* open_seed_session(int port, bool binary) {
+    auto sock = connect_to_seed(port);
+    if (sock < 0) {
+        return NULL;
+    }
+    
+    auto session = new seed_session_t();
+    session->fd = sock;
+    session->port = port;
+    session->start = 0;
+    session->end = 0;
+    session->pending_replies = 0;
+    session->binary = false;
+    session->features = 0;
+    session->next_request_id = 0;
+    session->next_reply_id = 0;
+    
+    if (binary) {
+        auto negotiated = negotiate_wire_protocol(session);
+        if (negotiated == WIRE_NEGOTIATED) {
+            return session;
+        }
+        close_seed_session(session);
+        if (negotiated == WIRE_FAILED) {
+            return NULL;
+        }
+        // A hang-up could also be a current seed that failed to send BUSY,
+        // so only a text reply marks the port for good
+        if (negotiated == WIRE_TEXT_ONLY) {
+            pthread_mutex_lock(&connection_pool_mutex);
+            text_only_ports.insert(port);
+            pthread_mutex_unlock(&connection_pool_mutex);
+            LOG_CLIENT(LOG_DEBUG, "Port " + std::to_string(port) + " predates the binary protocol, using text");
+        }
+        return open_seed_session(port, false);
+    }
+    
+    session->pending_replies = 1; // the SESSION greeting
+    bool ok = false;
+    std::string payload;
+    if (!send_all(sock, "SESSION\n", strlen("SESSION\n")) ||
+        !read_session_response(session, &ok, payload) || !ok) {
+        if (session->busy) {
+            LOG_CLIENT(LOG_WARN, "Port " + std::to_string(port) + " is busy, leaving it to other seeds");
+        }
+        close_seed_session(session);
+        return NULL;
+    }
+    return session;
+}
+
+// ===== CONNECTION POOL =====
+// Warm sessions are kept per seed port and handed to the catalog, size and
+// transfer paths, so each of them stops paying a TCP handshake per request.
+
+// True if an idle pooled session can still be used: the seed hasn't closed
+// it and no stray bytes are waiting on it
+bool session_is_reusable(seed_session_t* session) {
+    if (session->start != session->end) {
+        return false;
+    }
+    char probe;
+    auto bytes = recv(session->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Take a live idle session to `port` from the pool, or NULL if there is
+// none. A NULL return is counted as a miss: the caller opens a new one.
+// Binary and text sessions are pooled side by side; asking for a binary
+// one settles for text when the seed is known to speak nothing else.
+seed_session_t* take_pooled_session(int port, bool binary) {
+    pthread_mutex_lock(&connection_pool_mutex);
+    auto& idle = connection_pool[port];
+    if (binary && text_only_ports.count(port) > 0) {
+        binary = false;
+    }
+    for (auto i = idle.size(); i-- > 0; ) {
+        auto session = idle[i];
+        if (session->binary != binary) {
+            continue;
+        }
+        idle.erase(idle.begin() + i);
+        if (session_is_reusable(session)) {
+            pool_stats.reuses++;
+            pthread_mutex_unlock(&connection_pool_mutex);
+            session->reused = true;
+            return session;
+        }
+        pool_stats.discards++;
+        close_seed_session(session);
+    }
+    pool_stats.misses++;
+    pthread_mutex_unlock(&connection_pool_mutex);
+    return NULL;
+}
+
+// Take a session to `port` from the pool, or open a new one. `binary`
+// prefers the wire protocol. Returns NULL if the seed is not running.
+seed_session_t* acquire_seed_session(int port, bool binary) {
+    binary = binary && wire_protocol;
+    auto pooled = take_pooled_session(port, binary);
+    if (pooled != NULL) {
+        return pooled;
+    }
+    
+    auto session = open_seed_session(port, binary);
+    if (session) {
+        session->reused = false;
+    }
+    return session;
+}
+
+// Hand a session back. Sessions that failed mid-request, or that still have
+// replies outstanding, are closed instead of pooled.
+void release_seed_session(seed_session_t* session, bool reusable) {
+    if (session == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&connection_pool_mutex);
+    auto& idle = connection_pool[session->port];
+    if (reusable && session->pending_replies == 0 && session->start == session->end &&
+        (int)idle.size() < POOL_MAX_IDLE_PER_SEED) {
+        idle.push_back(session);
+        session = NULL;
+    } else {
+        pool_stats.discards++;
+    }
+    pthread_mutex_unlock(&connection_pool_mutex);
+    
+    close_seed_session(session);
+}
+
+// Send one request to a seed over a pooled session and read its reply.
+// A pooled session the seed has since dropped is retried once on a fresh one.
+// With an `opcode` the seed is offered the binary protocol and sent
+// `request` if it takes it, `command` otherwise; `binary` reports which
+// of the two the reply is in.
+seed_call_result_t seed_wire_call(int port, uint8_t opcode, const std::string& request, const char* command,
+                                  bool* ok, bool* binary, std::string& payload) {
+    for (auto attempt = 0; attempt < 2; attempt++) {
+        auto session = acquire_seed_session(port, opcode != 0);
+        if (session == NULL) {
+            return SEED_NOT_RUNNING;
+        }
+        
+        *binary = session->binary;
+        auto sent = session->binary ? send_wire_request(session, opcode, request) : send_session_request(session, command);
+        if (sent && read_session_response(session, ok, payload)) {
+            release_seed_session(session, true);
+            return SEED_CALL_OK;
+        }
+        
+        auto was_reused = session->reused;
+        release_seed_session(session, false);
+        if (!was_reused) {
+            break;
+        }
+    }
+    return SEED_NO_RESPONSE;
+}
+
+seed_call_result_t seed_call(int port, const char* command, bool* ok, std::string& payload) {
+    bool binary = false;
+    return seed_wire_call(port, 0, "", command, ok, &binary, payload);
+}
+
+std::string connection_pool_summary() {
+    pthread_mutex_lock(&connection_pool_mutex);
+    auto idle_count = 0;
+    for (auto it = connection_pool.begin(); it != connection_pool.end(); ++it) {
+        idle_count += it->second.size();
+    }
+    std::string summary = std::to_string(pool_stats.reuses) + " reused, " +
+                          std::to_string(pool_stats.misses) + " new, " +
+                          std::to_string(pool_stats.discards) + " discarded, " +
+                          std::to_string(idle_count) + " idle";
+    pthread_mutex_unlock(&connection_pool_mutex);
+    return summary;
+}
+
+// ===== PEER DISCOVERY =====
+// Discovery asks every other peer the same question at once: a warm pooled
+// session or a non-blocking connect for each of them, one poll() loop over
+// the lot, and a deadline per peer so a hung one costs at most
+// scan_timeout_ms instead of stalling the menu. Sessions that answered
+// cleanly go back into the pool for the download that usually follows.
+
+// Start scanning one peer. `fresh` skips the pool (used when a pooled
+// session turned out to be dead). Returns false if the peer is not running.
+bool start_peer_scan(scan_peer_t* peer, const char* command, bool fresh) {
+    peer->in.clear();
+    peer->from_pool = false;
+    
+    if (!fresh) {
+        auto session = take_pooled_session(peer->port, false);
+        if (session != NULL) {
+            peer->fd = session->fd;
+            delete session;
+            set_nonblocking(peer->fd);
+            peer->from_pool = true;
+            peer->out = std::string(command) + "\n";
+            peer->replies_left = 1;
+            peer->stage = SCAN_SENDING;
+            return true;
+        }
+    } else {
+        pthread_mutex_lock(&connection_pool_mutex);
+        pool_stats.misses++;
+        pthread_mutex_unlock(&connection_pool_mutex);
+    }
+    
+    peer->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (peer->fd < 0) {
+        return false;
+    }
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(peer->port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    
+    peer->out = "SESSION\n" + std::string(command) + "\n";
+    peer->replies_left = 2; // the SESSION greeting, then the answer
+    if (connect(peer->fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        peer->stage = SCAN_SENDING;
+    } else if (errno == EINPROGRESS) {
+        peer->stage = SCAN_CONNECTING;
+    } else {
+        close(peer->fd);
+        peer->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// Pull complete framed replies out of the peer's input. Returns false if
+// the peer sent something that isn't a reply.
+bool parse_scan_replies(scan_peer_t* peer, scan_result_t* result) {
+    while (peer->replies_left > 0) {
+        auto newline = peer->in.find('\n');
+        if (newline == std::string::npos) {
+            return true;
+        }
+        
+        bool ok;
+        size_t length;
+        auto header = peer->in.c_str();
+        if (peer->in.compare(0, newline + 1, BUSY_REPLY) == 0) {
+            LOG_CLIENT(LOG_WARN, "Port " + std::to_string(peer->port) + " is busy");
+            return false;
+        }
+        if (strncmp(header, "OK ", 3) == 0) {
+            ok = true;
+            length = strtoull(header + 3, NULL, 10);
+        } else if (strncmp(header, "ERROR ", 6) == 0) {
+            ok = false;
+            length = strtoull(header + 6, NULL, 10);
+        } else {
+            return false;
+        }
+        if (peer->in.size() < newline + 1 + length) {
+            return true;
+        }
+        
+        // The greeting only has to be OK; the last reply is the answer
+        if (peer->replies_left == 2 && !ok) {
+            return false;
+        }
+        if (peer->replies_left == 1) {
+            result->ok = ok;
+            result->payload = peer->in.substr(newline + 1, length);
+        }
+        peer->in.erase(0, newline + 1 + length);
+        peer->replies_left--;
+    }
+    return true;
+}
+
+// Done with a peer: a session that answered cleanly goes back to the pool
+void finish_peer_scan(scan_peer_t* peer, bool reusable) {
+    peer->stage = SCAN_FINISHED;
+    if (peer->fd < 0) {
+        return;
+    }
+    if (!reusable || !peer->in.empty()) {
+        close(peer->fd);
+        pthread_mutex_lock(&connection_pool_mutex);
+        pool_stats.discards++;
+        pthread_mutex_unlock(&connection_pool_mutex);
+        peer->fd = -1;
+        return;
+    }
+    
+    auto flags = fcntl(peer->fd, F_GETFL, 0);
+    fcntl(peer->fd, F_SETFL, flags & ~O_NONBLOCK);
+    set_seed_timeouts(peer->fd);
+    
+    auto session = new seed_session_t();
+    session->fd = peer->fd;
+    session->port = peer->port;
+    session->start = 0;
+    session->end = 0;
+    session->pending_replies = 0;
+    session->reused = false;
+    session->binary = false;
+    release_seed_session(session, true);
+    peer->fd = -1;
+}
+
+// A pooled session the peer has since dropped gets one fresh attempt
+void fail_peer_scan(scan_peer_t* peer, scan_result_t* result, const char* command) {
+    auto retry = peer->from_pool && peer->in.empty();
+    finish_peer_scan(peer, false);
+    if (retry && start_peer_scan(peer, command, true)) {
+        return;
+    }
+    result->result = retry ? SEED_NOT_RUNNING : SEED_NO_RESPONSE;
+}
+
+void advance_peer_scan(scan_peer_t* peer, scan_result_t* result, const char* command, short revents) {
+    if (peer->stage == SCAN_CONNECTING) {
+        auto error = 0;
+        socklen_t error_length = sizeof(error);
+        if (getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0 || error != 0) {
+            finish_peer_scan(peer, false);
+            result->result = SEED_NOT_RUNNING;
+            return;
+        }
+        peer->stage = SCAN_SENDING;
+    }
+    
+    if (peer->stage == SCAN_SENDING) {
+        auto sent = send(peer->fd, peer->out.data(), peer->out.size(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fail_peer_scan(peer, result, command);
+            }
+            return;
+        }
+        peer->out.erase(0, sent);
+        if (peer->out.empty()) {
+            peer->stage = SCAN_READING;
+        }
+        return;
+    }
+    
+    if (peer->stage == SCAN_READING && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        char buffer[4096];
+        while (1) {
+            auto bytes = recv(peer->fd, buffer, sizeof(buffer), 0);
+            if (bytes > 0) {
+                peer->in.append(buffer, bytes);
+                continue;
+            }
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            // Closed by the peer; fine only if it answered first and owed nothing more
+            if (!parse_scan_replies(peer, result) || peer->replies_left > 0) {
+                fail_peer_scan(peer, result, command);
+            } else if (peer->on_reply != NULL && result->ok && !peer->on_reply(result, peer->reply_arg).empty()) {
+                finish_peer_scan(peer, false);
+                result->result = SEED_NO_RESPONSE;
+            } else {
+                result->result = SEED_CALL_OK;
+                finish_peer_scan(peer, false);
+            }
+            return;
+        }
+        
+        if (!parse_scan_replies(peer, result)) {
+            fail_peer_scan(peer, result, command);
+        } else if (peer->replies_left == 0) {
+            if (peer->on_reply != NULL && result->ok) {
+                // Follow-up on the same session; each one gets a fresh deadline.
+                // The session has proven alive, so a failure now isn't retried.
+                auto next = peer->on_reply(result, peer->reply_arg);
+                if (!next.empty()) {
+                    peer->out = next + "\n";
+                    peer->replies_left = 1;
+                    peer->from_pool = false;
+                    peer->stage = SCAN_SENDING;
+                    peer->deadline = monotonic_seconds() + scan_timeout_ms / 1000.0;
+                    return;
+                }
+            }
+            result->result = SEED_CALL_OK;
+            finish_peer_scan(peer, true);
+        }
+    }
+}
+
+// Send `command` to every other peer at once (or only to `ports`) and
+// collect their answers, in PORTS order. Peers that haven't answered by
+// their deadline are reported as not responding. With `on_reply`, each
+// answer is handed to it and the peer keeps going for as long as it asks
+// for another request.
+void scan_peers(const char* command, std::vector<scan_result_t>& results, const std::vector<int>* ports,
+                scan_reply_fn on_reply, void* reply_arg) {
+    results.clear();
+    std::vector<scan_peer_t> peers;
+    auto started_at = monotonic_seconds();
+    
     for (auto i = 0; i < MAX_PORTS; i++) {
         if (PORTS[i] == my_bound_port) {
-            my_folder_id = i + 1;
+            continue;
+        }
+        if (ports != NULL && std::find(ports->begin(), ports->end(), PORTS[i]) == ports->end()) {
+            continue;
+        }
+        scan_result_t result;
+        result.port = PORTS[i];
+        result.result = SEED_NO_RESPONSE;
+        result.ok = false;
+        results.push_back(result);
+        
+        scan_peer_t peer;
+        peer.fd = -1;
+        peer.port = PORTS[i];
+        peer.deadline = started_at + scan_timeout_ms / 1000.0;
+        peer.on_reply = on_reply;
+        peer.reply_arg = reply_arg;
+        if (!start_peer_scan(&peer, command, false)) {
+            peer.stage = SCAN_FINISHED;
+            results.back().result = SEED_NOT_RUNNING;
+        }
+        peers.push_back(peer);
+    }
+    
+    std::vector<struct pollfd> poll_fds;
+    std::vector<int> poll_peers;
+    while (1) {
+        poll_fds.clear();
+        poll_peers.clear();
+        auto now = monotonic_seconds();
+        auto wait_ms = -1;
+        for (size_t i = 0; i < peers.size(); i++) {
+            auto& peer = peers[i];
+            if (peer.stage == SCAN_FINISHED) {
+                continue;
+            }
+            if (now >= peer.deadline) {
+                LOG_CLIENT(LOG_WARN, "Port " + std::to_string(peer.port) + " did not answer within " + std::to_string(scan_timeout_ms) + "ms");
+                finish_peer_scan(&peer, false);
+                results[i].result = SEED_NO_RESPONSE;
+                continue;
+            }
+            struct pollfd entry;
+            entry.fd = peer.fd;
+            entry.events = peer.stage == SCAN_READING ? POLLIN : POLLOUT;
+            entry.revents = 0;
+            poll_fds.push_back(entry);
+            poll_peers.push_back(i);
+            
+            auto peer_wait = (int)((peer.deadline - now) * 1000) + 1;
+            if (wait_ms < 0 || peer_wait < wait_ms) {
+                wait_ms = peer_wait;
+            }
+        }
+        if (poll_fds.empty()) {
             break;
         }
+        
+        if (poll(poll_fds.data(), poll_fds.size(), wait_ms) < 0 && errno != EINTR) {
+            break;
+        }
+        for (size_t i = 0; i < poll_fds.size(); i++) {
+            if (poll_fds[i].revents != 0) {
+                auto index = poll_peers[i];
+                advance_peer_scan(&peers[index], &results[index], command, poll_fds[i].revents);
+            }
+        }
+    }
+    
+    // Only reached early if poll() itself failed
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (peers[i].stage != SCAN_FINISHED) {
+            finish_peer_scan(&peers[i], false);
+        }
+    }
+    
+    LOG_CLIENT(LOG_DEBUG, "Scanned " + std::to_string(peers.size()) + " peer(s) for " + std::string(command) + " in " + std::to_string((int)((monotonic_seconds() - started_at) * 1000)) + "ms");
+}
+
+// ===== SEED SCORING =====
+// Every finished piece feeds its throughput and time to first byte into an
+// EWMA per port. A seed's score is the rate it would deliver a
+// SCORE_REFERENCE_PIECE at, latency included, and the download engine
+// hands out work in proportion to it.
+
+void record_seed_sample(int port, double throughput, double latency) {
+    pthread_mutex_lock(&seed_score_mutex);
+    auto it = seed_scores.find(port);
+    if (it == seed_scores.end()) {
+        seed_score_t score = {throughput, latency, 1, 0};
+        seed_scores[port] = score;
+    } else {
+        auto& score = it->second;
+        score.throughput += SCORE_EWMA_WEIGHT * (throughput - score.throughput);
+        score.latency += SCORE_EWMA_WEIGHT * (latency - score.latency);
+        score.samples++;
+    }
+    pthread_mutex_unlock(&seed_score_mutex);
+}
+
+// A lost session or bad reply halves the seed's throughput estimate
+void record_seed_failure(int port) {
+    pthread_mutex_lock(&seed_score_mutex);
+    auto it = seed_scores.find(port);
+    if (it != seed_scores.end()) {
+        it->second.throughput /= 2;
+        it->second.failures++;
+    } else {
+        seed_score_t score = {0, 0, 0, 1};
+        seed_scores[port] = score;
+    }
+    pthread_mutex_unlock(&seed_score_mutex);
+}
+
+double score_value(const seed_score_t& score) {
+    if (score.samples == 0 || score.throughput <= 0) {
+        return 0;
+    }
+    return SCORE_REFERENCE_PIECE / (score.latency + SCORE_REFERENCE_PIECE / score.throughput);
+}
+
+// Relative weights for a set of seeds. Seeds without samples yet get the
+// average of the known ones (or all count equally when none are known);
+// failed ones still get a small share so they can earn their score back.
+std::vector<double> seed_weights(const std::vector<int>& ports) {
+    std::vector<double> weights(ports.size(), 0);
+    auto known_total = 0.0;
+    auto known_count = 0;
+    
+    pthread_mutex_lock(&seed_score_mutex);
+    for (size_t i = 0; i < ports.size(); i++) {
+        auto it = seed_scores.find(ports[i]);
+        if (it != seed_scores.end() && it->second.samples > 0) {
+            weights[i] = score_value(it->second);
+            known_total += weights[i];
+            known_count++;
+        } else {
+            weights[i] = -1;
+        }
+    }
+    pthread_mutex_unlock(&seed_score_mutex);
+    
+    auto fallback = known_count > 0 && known_total > 0 ? known_total / known_count : 1.0;
+    for (size_t i = 0; i < weights.size(); i++) {
+        if (weights[i] < 0) {
+            weights[i] = fallback;
+        }
+        if (weights[i] < fallback * 0.05) {
+            weights[i] = fallback * 0.05;
+        }
+    }
+    return weights;
+}
+
+// Look up a seed's history; returns false if it has none
+bool get_seed_score(int port, seed_score_t* score) {
+    pthread_mutex_lock(&seed_score_mutex);
+    auto it = seed_scores.find(port);
+    auto found = it != seed_scores.end();
+    if (found) {
+        *score = it->second;
+    }
+    pthread_mutex_unlock(&seed_score_mutex);
+    return found;
+}
+
+void show_seed_scores() {
+    pthread_mutex_lock(&seed_score_mutex);
+    if (seed_scores.empty()) {
+        pthread_mutex_unlock(&seed_score_mutex);
+        return;
+    }
+    auto total = 0.0;
+    for (auto it = seed_scores.begin(); it != seed_scores.end(); ++it) {
+        total += score_value(it->second);
+    }
+    std::cout << "Seed scores:" << std::endl;
+    for (auto it = seed_scores.begin(); it != seed_scores.end(); ++it) {
+        auto& score = it->second;
+        auto value = score_value(score);
+        std::cout << "    Port " << it->first << ": " << format_file_size((long long)score.throughput) << "/s, "
+                  << std::fixed << std::setprecision(2) << score.latency * 1000 << "ms to first byte, score "
+                  << format_file_size((long long)value) << "/s ("
+                  << std::setprecision(0) << (total > 0 ? value * 100 / total : 0) << "% share), "
+                  << score.samples << " samples, " << score.failures << " failures" << std::endl;
+    }
+    pthread_mutex_unlock(&seed_score_mutex);
+}
+
+// ===== PARALLEL DOWNLOAD ENGINE =====
+// One worker per seed. The file is split into fixed-size chunks and every
+// worker starts with an equal contiguous share. A worker takes runs of
+// chunks from the front of its own share and asks for each run as one
+// ranged DOWNLOAD (a "piece"); once its share runs dry it steals the back
+// half of whichever share has the most left, so fast seeds end up doing
+// the work of slow ones. Chunk state lives in lock-free bitmaps and each
+// piece is pwrite()n straight to its offset in a preallocated file.
+//
+// Piece size is chosen per seed from the measured bandwidth and
+// time-to-first-byte of that seed's recent pieces, between
+// download_min_piece_size and download_max_piece_size.
+
+// Work ranges are [begin, end) chunk indexes packed into one 64-bit word so
+// the owner (taking from the front) and thieves (taking from the back) can
+// both update them with a single compare-and-swap
+uint64_t pack_range(uint32_t begin, uint32_t end) {
+    return ((uint64_t)begin << 32) | end;
+}
+
+uint32_t range_begin(uint64_t range) {
+    return (uint32_t)(range >> 32);
+}
+
+uint32_t range_end(uint64_t range) {
+    return (uint32_t)range;
+}
+
+void bitmap_init(chunk_bitmap_t* bitmap, int bit_count) {
+    bitmap->bit_count = bit_count;
+    bitmap->word_count = (bit_count + 63) / 64;
+    bitmap->words = new std::atomic<uint64_t>[bitmap->word_count];
+    for (auto i = 0; i < bitmap->word_count; i++) {
+        bitmap->words[i].store(0);
+    }
+}
+
+void bitmap_free(chunk_bitmap_t* bitmap) {
+    delete[] bitmap->words;
+    bitmap->words = NULL;
+}
+
+bool bitmap_test(chunk_bitmap_t* bitmap, int bit) {
+    return (bitmap->words[bit / 64].load(std::memory_order_acquire) >> (bit % 64)) & 1;
+}
+
+// Set a bit; returns true if this call is the one that set it
+bool bitmap_set(chunk_bitmap_t* bitmap, int bit) {
+    uint64_t mask = 1ULL << (bit % 64);
+    return (bitmap->words[bit / 64].fetch_or(mask, std::memory_order_acq_rel) & mask) == 0;
+}
+
+void bitmap_clear(chunk_bitmap_t* bitmap, int bit) {
+    bitmap->words[bit / 64].fetch_and(~(1ULL << (bit % 64)), std::memory_order_acq_rel);
+}
+
+// Claim up to max_count chunks starting at `first`. Stops at the first one
+// somebody else already holds; returns how many were claimed.
+int claim_run(parallel_ctx_t* ctx, int first, int max_count) {
+    auto count = 0;
+    while (count < max_count && first + count < ctx->total_chunks &&
+           bitmap_set(&ctx->claimed, first + count)) {
+        count++;
+    }
+    return count;
+}
+
+// Take up to max_count chunks from the front of a worker's own range.
+// Returns the number taken (0 if the range is empty) and the first in *first.
+int take_own_run(parallel_ctx_t* ctx, int seed_index, int max_count, int* first) {
+    auto& range = ctx->workers[seed_index].range;
+    auto current = range.load(std::memory_order_acquire);
+    while (range_begin(current) < range_end(current)) {
+        auto begin = range_begin(current);
+        auto count = range_end(current) - begin;
+        if (count > (uint32_t)max_count) {
+            count = max_count;
+        }
+        if (range.compare_exchange_weak(current, pack_range(begin + count, range_end(current)),
+                                        std::memory_order_acq_rel)) {
+            *first = begin;
+            return count;
+        }
+    }
+    return 0;
+}
+
+// Steal the back half of the largest remaining range into our own.
+// Returns false when there is nothing left worth stealing.
+bool steal_chunks(parallel_ctx_t* ctx, int seed_index) {
+    while (1) {
+        auto victim = -1;
+        uint32_t victim_left = 0;
+        for (auto i = 0; i < ctx->seed_count; i++) {
+            if (i == seed_index) {
+                continue;
+            }
+            auto current = ctx->workers[i].range.load(std::memory_order_acquire);
+            auto left = range_end(current) - range_begin(current);
+            if (range_begin(current) < range_end(current) && left > victim_left) {
+                victim = i;
+                victim_left = left;
+            }
+        }
+        if (victim == -1) {
+            return false;
+        }
+        
+        auto& range = ctx->workers[victim].range;
+        auto current = range.load(std::memory_order_acquire);
+        auto begin = range_begin(current);
+        auto end = range_end(current);
+        if (begin >= end) {
+            continue; // drained while we looked; pick again
+        }
+        
+        // A live victim keeps a front part in proportion to its score
+        // against ours; a dead one (or a single remaining chunk) is taken whole
+        auto middle = begin;
+        if (!ctx->workers[victim].finished.load() && end - begin >= 2) {
+            std::vector<int> pair;
+            pair.push_back(ctx->workers[seed_index].port);
+            pair.push_back(ctx->workers[victim].port);
+            auto weights = seed_weights(pair);
+            auto taken = (uint32_t)((end - begin) * weights[0] / (weights[0] + weights[1]));
+            if (taken < 1) {
+                taken = 1;
+            }
+            if (taken > end - begin - 1) {
+                taken = end - begin - 1;
+            }
+            middle = end - taken;
+        }
+        if (range.compare_exchange_strong(current, pack_range(begin, middle), std::memory_order_acq_rel)) {
+            ctx->workers[seed_index].range.store(pack_range(middle, end), std::memory_order_release);
+            ctx->workers[seed_index].steals++;
+            return true;
+        }
+    }
+}
+
+// Last resort: sweep the bitmaps for chunks nobody holds (ones that
+// failed on another seed). Returns the run length claimed.
+int sweep_unclaimed_run(parallel_ctx_t* ctx, int max_count, int* first) {
+    for (auto w = 0; w < ctx->done.word_count; w++) {
+        auto free_bits = ~(ctx->done.words[w].load(std::memory_order_acquire) |
+                           ctx->claimed.words[w].load(std::memory_order_acquire));
+        while (free_bits != 0) {
+            auto chunk = w * 64 + __builtin_ctzll(free_bits);
+            if (chunk >= ctx->total_chunks) {
+                break;
+            }
+            auto count = claim_run(ctx, chunk, max_count);
+            if (count > 0) {
+                *first = chunk;
+                return count;
+            }
+            free_bits &= free_bits - 1;
+        }
+    }
+    return 0;
+}
+
+// Return the unused tail of a run to the front of the worker's own range.
+// Only the owner moves the front, so it is still where we left it.
+void give_back_run(parallel_ctx_t* ctx, int seed_index, uint32_t taken_end, uint32_t new_begin) {
+    auto& range = ctx->workers[seed_index].range;
+    auto current = range.load(std::memory_order_acquire);
+    while (range_begin(current) == taken_end &&
+           !range.compare_exchange_weak(current, pack_range(new_begin, range_end(current)),
+                                        std::memory_order_acq_rel)) {
+    }
+}
+
+// Next run of chunks for this worker: own range, then stealing, then the sweep
+int next_run(parallel_ctx_t* ctx, int seed_index, int max_count, int* first) {
+    while (1) {
+        auto count = take_own_run(ctx, seed_index, max_count, first);
+        if (count > 0) {
+            // Skip chunks that are already held (resumed from disk, or taken
+            // by a sweep), claim what follows and hand back anything past
+            // the next held chunk
+            auto skip = 0;
+            while (skip < count && bitmap_test(&ctx->claimed, *first + skip)) {
+                skip++;
+            }
+            auto claimed = claim_run(ctx, *first + skip, count - skip);
+            give_back_run(ctx, seed_index, *first + count, *first + skip + claimed);
+            if (claimed > 0) {
+                *first += skip;
+                return claimed;
+            }
+            continue;
+        }
+        if (!steal_chunks(ctx, seed_index)) {
+            return sweep_unclaimed_run(ctx, max_count, first);
+        }
+    }
+}
+
+double monotonic_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Fold one finished piece into the seed's bandwidth/latency estimate and
+// pick the next piece size. A piece should cover at least one
+// bandwidth-delay product, and take roughly PIECE_TARGET_SECONDS so the
+// per-request overhead stays small. Changes are limited to 2x per piece.
+void update_piece_size(parallel_ctx_t* ctx, seed_worker_state_t* state, long long bytes,
+                       double first_byte_seconds, double transfer_seconds) {
+    if (transfer_seconds < 1e-6) {
+        transfer_seconds = 1e-6;
+    }
+    double sample_bandwidth = bytes / transfer_seconds;
+    double bandwidth = state->bandwidth.load();
+    if (bandwidth <= 0) {
+        bandwidth = sample_bandwidth;
+        state->rtt = first_byte_seconds;
+    } else {
+        bandwidth = 0.7 * bandwidth + 0.3 * sample_bandwidth;
+        state->rtt = 0.7 * state->rtt + 0.3 * first_byte_seconds;
+    }
+    state->bandwidth.store((long long)bandwidth);
+    record_seed_sample(state->port, sample_bandwidth, first_byte_seconds);
+    
+    auto current = state->piece_size.load();
+    double target = bandwidth * state->rtt;
+    if (target < bandwidth * PIECE_TARGET_SECONDS) {
+        target = bandwidth * PIECE_TARGET_SECONDS;
+    }
+    if (target > current * 2.0) {
+        target = current * 2.0;
+    }
+    if (target < current / 2.0) {
+        target = current / 2.0;
+    }
+    if (target > download_max_piece_size) {
+        target = download_max_piece_size;
+    }
+    if (target < download_min_piece_size) {
+        target = download_min_piece_size;
+    }
+    
+    // Whole chunks only
+    auto piece_size = ((long long)target / ctx->chunk_size) * ctx->chunk_size;
+    if (piece_size < ctx->chunk_size) {
+        piece_size = ctx->chunk_size;
+    }
+    if (piece_size != current) {
+        state->piece_size.store(piece_size);
+        LOG_CLIENT(LOG_DEBUG, "[" + std::string(ctx->filename) + "] Port " + std::to_string(state->port) + " piece size " + format_file_size(current) + " -> " + format_file_size(piece_size) + " (" + format_file_size((long long)bandwidth) + "/s, " + std::to_string((int)(state->rtt * 1e6)) + "us to first byte)");
+    }
+}
+
+// True if one of this worker's own pending requests covers the chunk
+bool holds_chunk(seed_worker_state_t* state, int chunk) {
+    for (size_t i = 0; i < state->in_flight.size(); i++) {
+        auto& piece = state->in_flight[i];
+        if (chunk >= piece.first_chunk && chunk < piece.first_chunk + piece.chunk_count) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Endgame: once nothing is left to claim and only the tail of the file is
+// outstanding, an idle worker asks for a run of chunks another seed is still
+// fetching. Each chunk is duplicated at most once and whichever copy lands
+// first is kept, so the download no longer waits on the slowest seed.
+// The tail is ENDGAME_TAIL_SHARE of the file, at least one pipeline of
+// chunks so small files get an endgame too, and at most ENDGAME_MAX_CHUNKS.
+int next_endgame_run(parallel_ctx_t* ctx, int seed_index, int max_count, int* first) {
+    auto tail = (int)(ctx->total_chunks * ENDGAME_TAIL_SHARE);
+    tail = std::min(std::max(tail, SESSION_PIPELINE_DEPTH), ENDGAME_MAX_CHUNKS);
+    auto outstanding = ctx->total_chunks - ctx->completed_chunks.load();
+    if (outstanding <= 0 || outstanding > tail) {
+        return 0;
     }
-    
-    if (my_folder_id == -1) {
-        response[0] = '\0';  // Safe way to clear string
-        return;
+    if (!ctx->endgame.exchange(true)) {
+        LOG_CLIENT(LOG_INFO, "[" + std::string(ctx->filename) + "] Endgame: " + std::to_string(outstanding) + " chunk(s) outstanding, duplicating them on idle seeds");
     }
     
-    char folder_path[256];
-    snprintf(folder_path, sizeof(folder_path), "files/seed%d/%d", my_folder_id, my_folder_id);
-    
-    response[0] = '\0';
-    DIR *dr = opendir(folder_path);
-    if (dr != NULL) {
-        struct dirent *de;
-        auto file_count = 0;
-        
-        while ((de = readdir(dr)) != NULL) {
-            if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
-                char file_entry[512];
-                snprintf(file_entry, sizeof(file_entry), "[%d] %s\n", ++file_count, de->d_name);
-                
-                // Safe string concatenation with bounds checking
-                size_t current_len = strlen(response);
-                size_t entry_len = strlen(file_entry);
-                if (current_len + entry_len < (size_t)max_size - 1) {
-                    strncat(response, file_entry, max_size - current_len - 1);
-                } else {
-                    break; // Buffer full, stop adding files
-                }
+    auto state = &ctx->workers[seed_index];
+    for (auto w = 0; w < ctx->done.word_count; w++) {
+        auto candidates = ctx->claimed.words[w].load(std::memory_order_acquire) &
+                          ~ctx->done.words[w].load(std::memory_order_acquire) &
+                          ~ctx->duplicated.words[w].load(std::memory_order_acquire);
+        while (candidates != 0) {
+            auto chunk = w * 64 + __builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+            if (chunk >= ctx->total_chunks) {
+                break;
+            }
+            
+            auto count = 0;
+            while (count < max_count && chunk + count < ctx->total_chunks &&
+                   !bitmap_test(&ctx->done, chunk + count) &&
+                   bitmap_test(&ctx->claimed, chunk + count) &&
+                   !holds_chunk(state, chunk + count) &&
+                   bitmap_set(&ctx->duplicated, chunk + count)) {
+                count++;
+            }
+            if (count > 0) {
+                *first = chunk;
+                return count;
             }
         }
-        closedir(dr);
     }
+    return 0;
 }
 
-// Handle port requests (server side)
-void* port_request(void* arg) {
-    auto client_filehandle = *(int*)arg; // extract the value
-    free(arg);  //free the memory
-    
-    char buffer[1024]; //buffer to hold the data from the client
-    auto bytes = recv(client_filehandle, buffer, sizeof(buffer) - 1, 0); //waits client to send something
-    if (bytes <= 0) {
-        close(client_filehandle);
-        return NULL;
-    }
-    buffer[bytes] = '\0';
-    
+// Wake idle workers: a piece landed, chunks were handed back or a worker
+// exited, any of which can leave them something to do
+void signal_work_changed(parallel_ctx_t* ctx) {
+    pthread_mutex_lock(&ctx->inflight_mutex);
+    ctx->work_epoch++;
+    pthread_cond_broadcast(&ctx->work_changed);
+    pthread_mutex_unlock(&ctx->inflight_mutex);
+}
 
+bool piece_is_done(parallel_ctx_t* ctx, const piece_request_t& piece) {
+    for (auto i = 0; i < piece.chunk_count; i++) {
+        if (!bitmap_test(&ctx->done, piece.first_chunk + i)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    if (strcmp(buffer, "LIST") == 0) {
-        char response[2048];
-        get_own_files(response, sizeof(response));
-        send(client_filehandle, response, strlen(response), 0); //sending back to client
+// Cancel other workers that are waiting on a piece that has already been
+// won. The request cannot be withdrawn from the seed, so the session is shut
+// down; the worker sees the read fail, hands back its other pieces and stops.
+void cancel_won_duplicates(parallel_ctx_t* ctx, int seed_index) {
+    pthread_mutex_lock(&ctx->inflight_mutex);
+    for (auto i = 0; i < ctx->seed_count; i++) {
+        auto& other = ctx->workers[i];
+        if (i == seed_index || other.session_fd < 0 || other.cancelled || other.in_flight.empty()) {
+            continue;
+        }
+        if (piece_is_done(ctx, other.in_flight.front())) {
+            other.cancelled = true;
+            shutdown(other.session_fd, SHUT_RDWR);
+        }
     }
-    else if (strncmp(buffer, "FILESIZE ", 9) == 0) {
-        // Handle FILESIZE command
-        char filename[MAX_FILENAME_LENGTH];
-        size_t filename_len = strlen(buffer + 9);
-        if (filename_len < MAX_FILENAME_LENGTH) {
-            strncpy(filename, buffer + 9, MAX_FILENAME_LENGTH - 1);
-            filename[MAX_FILENAME_LENGTH - 1] = '\0';
-        } else {
-            char error_msg[] = "ERROR: Filename too long";
-            send(client_filehandle, error_msg, strlen(error_msg), 0);
-            close(client_filehandle);
-            return NULL;
+    pthread_mutex_unlock(&ctx->inflight_mutex);
+}
+
+// Give back the unfinished chunks of everything still in flight so other
+// seeds can pick them up, and close the session. Returns true if the session
+// was cancelled on purpose rather than lost.
+bool drop_worker_session(parallel_ctx_t* ctx, seed_worker_state_t* state, seed_session_t* session, bool reusable) {
+    pthread_mutex_lock(&ctx->inflight_mutex);
+    for (size_t i = 0; i < state->in_flight.size(); i++) {
+        auto& piece = state->in_flight[i];
+        for (auto c = 0; c < piece.chunk_count; c++) {
+            if (!bitmap_test(&ctx->done, piece.first_chunk + c) && !piece.duplicate) {
+                bitmap_clear(&ctx->claimed, piece.first_chunk + c);
+            }
         }
+    }
+    state->in_flight.clear();
+    auto cancelled = state->cancelled;
+    state->cancelled = false;
+    state->session_fd = -1;
+    ctx->work_epoch++;
+    pthread_cond_broadcast(&ctx->work_changed);
+    pthread_mutex_unlock(&ctx->inflight_mutex);
+    
+    release_seed_session(session, reusable && !cancelled);
+    return cancelled;
+}
+
+void* parallel_download_worker(void* arg) {
+    auto worker = (worker_arg_t*)arg;
+    auto ctx = worker->ctx;
+    auto seed_index = worker->seed_index;
+    auto state = &ctx->workers[seed_index];
+    auto seed_port = state->port;
+    delete worker;
+    
+    auto port_label = "port=\"" + std::to_string(seed_port) + "\"";
+    auto seed_bytes_metric = get_metric("client_seed_bytes_received_total", port_label, METRIC_COUNTER);
+    auto seed_throughput_metric = get_metric("client_seed_throughput_bytes_per_second", port_label, METRIC_GAUGE);
+    
+    std::vector<char> piece_data;
+    auto healthy = true;
+    seed_session_t* session = NULL;
+    auto last_completion = monotonic_seconds();
+    
+    while (healthy && ctx->completed_chunks.load() < ctx->total_chunks && !ctx->write_failed.load()) {
+        // Read before claiming, so a change made while we look isn't slept through
+        auto epoch = ctx->work_epoch.load();
         
-        // Remove trailing whitespace/newlines
-        auto newline = strchr(filename, '\n');
-        if (newline) *newline = '\0';
-        
-        // Find the file and get its size
-        auto my_folder_id = -1;
-        for (auto i = 0; i < MAX_PORTS; i++) {
-            if (PORTS[i] == my_bound_port) {
-                my_folder_id = i + 1;
+        // Keep the pipeline full
+        auto session_lost = false;
+        while ((int)state->in_flight.size() < SESSION_PIPELINE_DEPTH) {
+            auto max_count = (int)(state->piece_size.load() / ctx->chunk_size);
+            piece_request_t piece;
+            piece.duplicate = false;
+            piece.chunk_count = next_run(ctx, seed_index, max_count, &piece.first_chunk);
+            if (piece.chunk_count == 0) {
+                piece.chunk_count = next_endgame_run(ctx, seed_index, max_count, &piece.first_chunk);
+                piece.duplicate = true;
+            }
+            if (piece.chunk_count == 0) {
                 break;
             }
-        }
-        
-        if (my_folder_id != -1) {
-            char file_path[1024];
-            snprintf(file_path, sizeof(file_path), "files/seed%d/%d/%s", my_folder_id, my_folder_id, filename);
             
-            FILE *file = fopen(file_path, "rb");
-            if (file) {
-                // Get exact file size
-                fseek(file, 0, SEEK_END);
-                long file_size = ftell(file);
-                fclose(file);
-                
-                // Send size response
-                char size_response[64];
-                snprintf(size_response, sizeof(size_response), "SIZE:%ld", file_size);
-                send(client_filehandle, size_response, strlen(size_response), 0);
-                
-                std::stringstream ss;
-                ss << "SEED PORT " << my_bound_port << ": Client requested file size for '" << filename << "' → Responding with " << file_size << " bytes";
-                log_server(ss.str());
-            } else {
-                char error_msg[] = "ERROR: File not found";
-                send(client_filehandle, error_msg, strlen(error_msg), 0);
+            piece.offset = (long long)piece.first_chunk * ctx->chunk_size;
+            piece.length = (long long)piece.chunk_count * ctx->chunk_size;
+            if (piece.length > ctx->file_size - piece.offset) {
+                piece.length = ctx->file_size - piece.offset;
+            }
+            // All transfers draw from the same bandwidth budget
+            wait_for_bandwidth(piece.length);
+            piece.sent_at = monotonic_seconds();
+            
+            // Sessions are opened only once there is work for them
+            if (session == NULL) {
+                session = acquire_seed_session(seed_port, true);
+                if (session == NULL) {
+                    LOG_CLIENT(LOG_ERROR, "Failed to open session with seed at port " + std::to_string(seed_port));
+                    for (auto i = 0; i < piece.chunk_count && !piece.duplicate; i++) {
+                        bitmap_clear(&ctx->claimed, piece.first_chunk + i);
+                    }
+                    healthy = false;
+                    break;
+                }
+                last_completion = monotonic_seconds();
+            }
+            
+            // Listed before sending so a failed send hands it back with the rest
+            pthread_mutex_lock(&ctx->inflight_mutex);
+            state->session_fd = session->fd;
+            state->in_flight.push_back(piece);
+            pthread_mutex_unlock(&ctx->inflight_mutex);
+            if (piece.duplicate) {
+                state->duplicates_sent++;
+            }
+            
+            if (!send_download_request(session, ctx->filename, piece.offset, piece.length)) {
+                session_lost = true;
+                break;
             }
         }
-    }
-    else if (strncmp(buffer, "DOWNLOAD ", 9) == 0) {
-        // Parse DOWNLOAD command - format: "DOWNLOAD filename offset"
-        char filename[MAX_FILENAME_LENGTH];
-        long long offset = 0;
         
-        // Parse filename and offset using | delimiter
-        char* delimiter_pos = strchr(buffer + 9, '|');
-        if (delimiter_pos) {
-            // Has offset parameter
-            size_t filename_len = delimiter_pos - (buffer + 9);
-            if (filename_len < MAX_FILENAME_LENGTH) {
-                strncpy(filename, buffer + 9, filename_len);
-                filename[filename_len] = '\0';
-                offset = atoll(delimiter_pos + 1);
-            } else {
-                char error_msg[] = "ERROR: Filename too long";
-                send(client_filehandle, error_msg, strlen(error_msg), 0);
-                close(client_filehandle);
-                return NULL;
+        if (!healthy) {
+            break;
+        }
+        if (!session_lost && state->in_flight.empty()) {
+            // Everything is claimed by other seeds; sleep until one of them
+            // hands chunks back, a piece lands or a worker exits
+            pthread_mutex_lock(&ctx->inflight_mutex);
+            auto others_alive = false;
+            for (auto i = 0; i < ctx->seed_count; i++) {
+                if (i != seed_index && !ctx->workers[i].finished.load()) {
+                    others_alive = true;
+                }
             }
-        } else {
-            // No offset, use original parsing
-            size_t filename_len = strlen(buffer + 9);
-            if (filename_len < MAX_FILENAME_LENGTH) {
-                strncpy(filename, buffer + 9, MAX_FILENAME_LENGTH - 1);
-                filename[MAX_FILENAME_LENGTH - 1] = '\0';
-            } else {
-                char error_msg[] = "ERROR: Filename too long";
-                send(client_filehandle, error_msg, strlen(error_msg), 0);
-                close(client_filehandle);
-                return NULL;
+            if (others_alive && ctx->work_epoch.load() == epoch) {
+                pthread_cond_wait(&ctx->work_changed, &ctx->inflight_mutex);
             }
+            pthread_mutex_unlock(&ctx->inflight_mutex);
+            if (!others_alive) {
+                break;
+            }
+            last_completion = monotonic_seconds();
+            continue;
         }
         
-        // Remove trailing whitespace/newlines
-        auto newline = strchr(filename, '\n');
-        if (newline) *newline = '\0';
-        
-        std::stringstream ss;
-        ss << "SEED PORT " << my_bound_port << ": Download request for '" << filename << "' starting at byte " << offset;
-        log_server(ss.str());
-        
-        // Find the file in our folder
-        auto my_folder_id = -1;
-        for (auto i = 0; i < MAX_PORTS; i++) {
-            if (PORTS[i] == my_bound_port) {
-                my_folder_id = i + 1;
+        bool ok = false;
+        size_t length = 0;
+        auto first_byte_at = 0.0;
+        if (!session_lost) {
+            session_lost = !read_session_header(session, &ok, &length);
+            first_byte_at = monotonic_seconds();
+        }
+        if (!session_lost) {
+            piece_data.resize(length > 0 ? length : 1);
+            session_lost = length > 0 && !read_session_payload(session, piece_data.data(), length);
+        }
+        if (session_lost) {
+            // Either another seed won our pieces and shut the session down,
+            // or the seed went away. A seed that lost the race in endgame is
+            // the slow one, so it leaves what remains to the others.
+            auto cancelled = drop_worker_session(ctx, state, session, false);
+            session = NULL;
+            if (cancelled) {
+                LOG_CLIENT(LOG_DEBUG, "[" + std::string(ctx->filename) + "] Cancelled duplicate request(s) on port " + std::to_string(seed_port) + "; leaving the rest to faster seeds");
                 break;
             }
+            LOG_CLIENT(LOG_WARN, "Lost session with seed at port " + std::to_string(seed_port));
+            healthy = false;
+            break;
         }
         
-        if (my_folder_id != -1) {
-            char file_path[1024];
-            snprintf(file_path, sizeof(file_path), "files/seed%d/%d/%s", my_folder_id, my_folder_id, filename);
-            
-            FILE *file = fopen(file_path, "rb");
-            if (file) {
-                // Get file size
-                fseek(file, 0, SEEK_END);
-                long file_size = ftell(file);
-                fseek(file, 0, SEEK_SET);
-                
-                std::stringstream ss2;
-                ss2 << "SEED PORT " << my_bound_port << ": File found (" << file_size << " bytes total)";
-                log_server(ss2.str());
-                
-                // Check if offset is valid
-                if (offset >= file_size) {
-                    log_server("SEED: Offset beyond file size, no more data to send");
-                    fclose(file);
-                    close(client_filehandle);
-                    return NULL;
-                }
-                
-                // Seek to the requested offset
-                fseek(file, offset, SEEK_SET);
-                
-                // Send one 32-byte chunk from the offset
-                char file_buffer[32];
-                size_t bytes_read = fread(file_buffer, 1, sizeof(file_buffer), file);
-                auto total_sent = 0;
-                
-                if (bytes_read > 0) {
-                    if (send(client_filehandle, file_buffer, bytes_read, 0) <= 0) {
-                        log_server("SEED: Send failed!");
-                    } else {
-                        total_sent += bytes_read;
-                        std::stringstream ss3;
-                        if (bytes_read == 32) {
-                            ss3 << "SEED PORT " << my_bound_port << ": Sent full chunk (32 bytes) from position " << offset << " to " << (offset + bytes_read - 1);
-                        } else {
-                            ss3 << "SEED PORT " << my_bound_port << ": Sent final chunk (" << bytes_read << " bytes) from position " << offset << " to " << (offset + bytes_read - 1) << " - FILE COMPLETE!";
-                        }
-                        log_server(ss3.str());
-                    }
-                } else {
-                    std::stringstream ss4;
-                    ss4 << "SEED PORT " << my_bound_port << ": No data available at offset " << offset << " (file may be complete)";
-                    log_server(ss4.str());
-                }
-                
-                fclose(file);
-                std::stringstream ss5;
-                ss5 << "SEED: Sent " << total_sent << " bytes of file '" << filename << "'.";
-                log_server(ss5.str());
-            } else {
-                std::stringstream ss6;
-                ss6 << "SEED PORT " << my_bound_port << ": File '" << filename << "' not found in local storage";
-                log_server(ss6.str());
-                
-                // Send error message
-                char error_msg[] = "ERROR: File not found";
-                send(client_filehandle, error_msg, strlen(error_msg), 0);
+        auto piece = state->in_flight.front();
+        
+        if (!ok || (long long)length != piece.length) {
+            LOG_CLIENT(LOG_WARN, "Seed error from port " + std::to_string(seed_port) + ": " + (ok ? std::string("short piece") : std::string(piece_data.data(), length)));
+            healthy = false;
+            break;
+        }
+        
+        // Pieces land directly at their offset, in whatever order they arrive.
+        // A duplicate whose chunks all landed already lost the race.
+        auto won = !piece_is_done(ctx, piece);
+        if (won && pwrite(ctx->file_fd, piece_data.data(), length, piece.offset) != (ssize_t)length) {
+            LOG_CLIENT(LOG_ERROR, "Error: Failed to write piece at offset " + std::to_string(piece.offset) + ": " + strerror(errno));
+            ctx->write_failed.store(true);
+            healthy = false;
+            break;
+        }
+        
+        pthread_mutex_lock(&ctx->inflight_mutex);
+        state->in_flight.pop_front();
+        pthread_mutex_unlock(&ctx->inflight_mutex);
+        
+        // The seed started on this piece when it was sent or when the previous
+        // one finished, whichever came later. A tail piece under one chunk says
+        // more about request overhead than bandwidth, so it is not sampled.
+        auto completed_at = monotonic_seconds();
+        auto started_at = piece.sent_at > last_completion ? piece.sent_at : last_completion;
+        if ((long long)length >= ctx->chunk_size) {
+            update_piece_size(ctx, state, length, first_byte_at - started_at, completed_at - started_at);
+            metric_set(seed_throughput_metric, state->bandwidth.load());
+        }
+        metric_observe(client_piece_latency_metric, (long long)((completed_at - piece.sent_at) * 1e6));
+        metric_add(client_bytes_received_metric, length);
+        metric_add(seed_bytes_metric, length);
+        last_completion = completed_at;
+        
+        // First copy of each chunk to land wins
+        auto new_chunks = 0;
+        long long new_bytes = 0;
+        for (auto i = 0; i < piece.chunk_count; i++) {
+            if (bitmap_set(&ctx->done, piece.first_chunk + i)) {
+                auto chunk_offset = (long long)(piece.first_chunk + i) * ctx->chunk_size;
+                new_chunks++;
+                new_bytes += std::min(ctx->chunk_size, ctx->file_size - chunk_offset);
             }
         }
+        ctx->wasted_bytes.fetch_add(length - new_bytes);
+        if (new_chunks == 0) {
+            continue;
+        }
+        if (piece.duplicate) {
+            state->duplicates_won++;
+        }
+        
+        // Progress lives in the context; the status screen reads it from there
+        auto completed = ctx->completed_chunks.fetch_add(new_chunks) + new_chunks;
+        ctx->downloaded_bytes.fetch_add(new_bytes);
+        signal_work_changed(ctx);
+        state->chunks += new_chunks;
+        auto pieces_from_this_seed = ++state->pieces;
+        LOG_CLIENT(LOG_TRACE, "[" + std::string(ctx->filename) + "] Port " + std::to_string(seed_port) + " sent " + std::to_string(length) + "-byte " + (piece.duplicate ? "duplicate " : "") + "piece at offset " + std::to_string(piece.offset) + " (" + std::to_string(completed) + "/" + std::to_string(ctx->total_chunks) + " chunks) [Total pieces from this seed: " + std::to_string(pieces_from_this_seed) + "]");
+        
+        if (ctx->endgame.load()) {
+            cancel_won_duplicates(ctx, seed_index);
+        }
     }
     
-    close(client_filehandle);
-    return NULL;
-}
-
-// Server thread to accept port connections
-void* server_thread(void* arg) {
-    //int server_filehandle = port_threads[0].socket_FileHandle; //setting a socket file handle for the server
-
-    auto server_filehandle = *(int*)arg; //this will get the client file handle from the argument
-    free(arg); //this will release heap memory in the malloc
-
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    
-    while (1) { //loop infinitely
-        auto client_filehandle = accept(server_filehandle, (struct sockaddr*)&client_addr, &client_len); // this will wait for other ports
-        if (client_filehandle >= 0) {
-            auto client_filehandle_ptr = (int*)malloc(sizeof(int));  // ths will allocate separate
-            // memory for the clients file handle so each threads has its own copy
-            if (client_filehandle_ptr == NULL) {
-                log_server("Error: Memory allocation failed");
-                close(client_filehandle);
-                continue;
-            }
-          
-            *client_filehandle_ptr = client_filehandle;
-            
-            //this will create a new thread for each client
-            pthread_t handler_thread;
-            pthread_create(&handler_thread, NULL, port_request, client_filehandle_ptr); //If new port is bounded, it will create a new thread
-            pthread_detach(handler_thread);
-        }
+    // Hand back anything still in flight so the other seeds can pick it up
+    if (session != NULL) {
+        drop_worker_session(ctx, state, session, healthy);
     }
+    if (!healthy) {
+        state->failed.store(true);
+        record_seed_failure(seed_port);
+    }
+    state->finished.store(true);
+    signal_work_changed(ctx);
+    ctx->active_workers--;
     return NULL;
 }
 
-void port_server() {
-    std::cout << "Finding available ports...";
+// Load the done bitmap from a resume sidecar. Returns false if the sidecar
+// is missing, damaged or describes a different file.
+bool load_resume_map(parallel_ctx_t* ctx) {
+    resume_map_header_t header;
+    if (pread(ctx->map_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, RESUME_MAP_MAGIC, sizeof(header.magic)) != 0 ||
+        header.file_size != ctx->file_size || header.chunk_size != ctx->chunk_size ||
+        header.total_chunks != ctx->total_chunks) {
+        return false;
+    }
     
-    for (auto i = 0; i < MAX_PORTS; i++) {
-        auto port = PORTS[i];
-        
-        //if (is_port_available(port)) {
-            auto sock = bind_and_listen(port);
-            if (sock >= 0) {
-                my_bound_port = port;
-                
-                // Set up port thread data
-                port_threads[0].port = port;
-                port_threads[0].folder_id = i + 1;
-                port_threads[0].thread_index = 0;
-                port_threads[0].socket_FileHandle = sock;
-                port_threads[0].is_bound = 1;
-                snprintf(port_threads[0].folder_path, sizeof(port_threads[0].folder_path), 
-                         "files/seed%d/%d", port_threads[0].folder_id, port_threads[0].folder_id);
-                
-                bound_port_count = 1;
-                
-                std::cout << " Found port " << port << "." << std::endl;
-                std::cout << "Listening at port " << port << "." << std::endl;
-                
-                // Start server thread to handle port requests
-
-                auto server_filehandle_ptr = (int*)malloc(sizeof(int));  
-                if (server_filehandle_ptr == NULL) {
-                    log_server("Error: Memory allocation failed");
-                    close(sock);
-                    return;
-                }
-                *server_filehandle_ptr = sock;
-                pthread_t server_tid;
-                pthread_create(&server_tid, NULL, server_thread, server_filehandle_ptr);
-                pthread_detach(server_tid);
-                
-                return;
-            }
-        //}
+    std::vector<uint64_t> words(ctx->done.word_count);
+    auto length = words.size() * sizeof(uint64_t);
+    if (pread(ctx->map_fd, words.data(), length, sizeof(header)) != (ssize_t)length) {
+        return false;
     }
     
-    std::cout << " No available ports found." << std::endl;
+    // Done chunks count as claimed so no worker asks for them again
+    for (auto w = 0; w < ctx->done.word_count; w++) {
+        ctx->done.words[w].store(words[w]);
+        ctx->claimed.words[w].store(words[w]);
+    }
+    return true;
 }
 
-void download_file(){
+// Start a fresh sidecar with an empty bitmap
+bool create_resume_map(parallel_ctx_t* ctx) {
+    resume_map_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RESUME_MAP_MAGIC, sizeof(header.magic));
+    header.file_size = ctx->file_size;
+    header.chunk_size = ctx->chunk_size;
+    header.total_chunks = ctx->total_chunks;
     
-     // Check if we have any files to download
-     pthread_mutex_lock(&file_list_mutex);
-     if (unique_file_count == 0) {
-         log_client("No files available to download. Please list files first (option 1).");
-         std::cout << "No files available to download. Please list files first (option 1)." << std::endl;
-         pthread_mutex_unlock(&file_list_mutex);
-         return;
-     }
-     
-     // Show available files
-     std::cout << "Available files for download:" << std::endl;
-     for (auto i = 0; i < unique_file_count; i++) {
-         std::cout << "[" << i + 1 << "] " << 
-                unique_files[i].filename << " (from seed at port " << unique_files[i].source_port << ")" << std::endl;
-     }
-     
-     // Get user's choice
-     std::cout << "\nEnter file ID: ";
-     auto file_choice = 0;
-     std::cin >> file_choice;
-     
-     // Validate choice
-     if (file_choice < 1 || file_choice > unique_file_count) {
-         log_client("Locating seeders... Failed - No seeders for file ID " + std::to_string(file_choice));
-         std::cout << "Locating seeders... Failed" << std::endl;
-         std::cout << "No seeders for file ID " << file_choice << "." <<std::endl;
-         pthread_mutex_unlock(&file_list_mutex);
-         return;
-     }
-     
-     // Get file info before releasing the mutex
-     char filename[MAX_FILENAME_LENGTH];
-     // Safe string copy with bounds checking
-     size_t filename_len = strlen(unique_files[file_choice - 1].filename);
-     if (filename_len < MAX_FILENAME_LENGTH) {
-         strncpy(filename, unique_files[file_choice - 1].filename, MAX_FILENAME_LENGTH - 1);
-         filename[MAX_FILENAME_LENGTH - 1] = '\0'; // Ensure null termination
-     } else {
-         log_client("Error: Filename too long.");
-         std::cout << "Error: Filename too long." << std::endl;
-         pthread_mutex_unlock(&file_list_mutex);
-         return;
-     }
-     pthread_mutex_unlock(&file_list_mutex);
-     
-     log_client("Scanning all seeds for file '" + std::string(filename) + "'...");
-     std::cout << "Scanning all seeds for file '" << filename << "'..." << std::endl;
-     
-     // Scan all seeds for this file
-     std::vector<int> available_seeds;
-     scan_seeds_for_file(filename, available_seeds);
-     
-     if (available_seeds.empty()) {
-         log_client("No seeds found with file '" + std::string(filename) + "'. Cannot download.");
-         std::cout << "No seeds found with file '" << filename << "'. Cannot download." << std::endl;
-         return;
-     }
-     
-     // Get expected file size from one of the seeds
-     auto expected_size = get_file_size_from_seed(available_seeds[0], filename);
-     if (expected_size <= 0) {
-         log_client("Could not determine file size. Download may fail.");
-         std::cout << "Could not determine file size. Download may fail." << std::endl;
-     } else {
-         log_client("Expected file size: " + std::to_string(expected_size) + " bytes");
-         std::cout << "Expected file size: " << expected_size << " bytes" << std::endl;
-         
-         // Check if file already exists locally with correct size
-         char existing_path[1024];
-         if (check_file_already_exists(filename, expected_size, existing_path, sizeof(existing_path))) {
-             log_client("File [" + std::to_string(file_choice) + "] " + std::string(filename) + " already exists");
-             std::cout << " File [" << file_choice << "] " << filename << " already exists" << std::endl;
-             return;
-         } else {
-             log_client("File not found locally or size mismatch. Starting download...");
-             std::cout << "File not found locally or size mismatch. Starting download..." << std::endl;
-         }
-     }
-     
-     // Check if there's already an active download
-     pthread_mutex_lock(&download_thread_mutex);
-     if (active_download.is_active) {
-         std::cout << "A download is already in progress. Please wait for it to complete." << std::endl;
-         log_client("Download request rejected - another download already in progress");
-         pthread_mutex_unlock(&download_thread_mutex);
-         return;
-     }
-     
-     // Set up download thread data
-     strncpy(active_download.filename, filename, MAX_FILENAME_LENGTH - 1);
-     active_download.filename[MAX_FILENAME_LENGTH - 1] = '\0';
-     active_download.available_seeds = new std::vector<int>(available_seeds);
-     active_download.is_active = true;
-     
-     // Initialize progress tracking
-     active_download.total_size = 0;
-     active_download.downloaded_bytes = 0;
-     active_download.total_chunks = 0;
-     active_download.completed_chunks = 0;
-     
-     // Create background download thread
-     if (pthread_create(&active_download.thread_id, NULL, download_thread_worker, &active_download) != 0) {
-         std::cout << "Error: Failed to create download thread" << std::endl;
-         log_client("Error: Failed to create download thread");
-         delete active_download.available_seeds;
-         active_download.is_active = false;
-         pthread_mutex_unlock(&download_thread_mutex);
-         return;
-     }
-     
-     // Detach thread so it runs independently
-     pthread_detach(active_download.thread_id);
-     pthread_mutex_unlock(&download_thread_mutex);
-     
-     std::cout << "Download started in background for file: " << filename << std::endl;
-     std::cout << "You can continue using the menu while the download progresses." << std::endl;
-     log_client("Background download initiated for file: " + std::string(filename));
+    std::vector<uint64_t> words(ctx->done.word_count, 0);
+    auto length = words.size() * sizeof(uint64_t);
+    return ftruncate(ctx->map_fd, 0) == 0 &&
+           pwrite(ctx->map_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+           pwrite(ctx->map_fd, words.data(), length, sizeof(header)) == (ssize_t)length &&
+           fdatasync(ctx->map_fd) == 0;
 }
-
-// New function to scan multiple seeds for the same file
-void scan_seeds_for_file(const char* filename, std::vector<int>& available_seeds) {
-    available_seeds.clear();
-    
-    // Try to connect to all other ports (excluding current bound port)
-    for (auto i = 0; i < MAX_PORTS; i++) {
-        auto port = PORTS[i];
-        if (port != my_bound_port) {  // Skip current bound port
-            log_client("Scanning seed at port " + std::to_string(port) + " for file '" + std::string(filename) + "'...");
-            std::cout << "Scanning seed at port " << port << "... ";
-            
-            auto sock = socket(AF_INET, SOCK_STREAM, 0);
-            if (sock < 0) {
-                log_client("socket failed for port " + std::to_string(port));
-                std::cout << "failed" << std::endl;
-                continue;
-            }
-            
-            struct sockaddr_in addr;
-            addr.sin_family = AF_INET;
-            addr.sin_port = htons(port);
-            inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-            
-            if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-                // Send LIST command to check if file exists
-                send(sock, "LIST", strlen("LIST"), 0);
-                
-                char buffer[1024];
-                auto n = recv(sock, buffer, sizeof(buffer) - 1, 0);
-                if (n > 0) {
-                    buffer[n] = '\0';
-                    
-                    // Check if filename exists in this seed's file list
-                    char* line = strtok(buffer, "\n");
-                    bool file_found = false;
-                    log_client("Checking files on seed " + std::to_string(port) + ":");
-                    while (line != NULL) {
-                        auto bracket_end = strchr(line, ']');
-                        if (bracket_end && bracket_end[1] == ' ') {
-                            auto seed_filename = bracket_end + 2;
-                            log_client("  Found: '" + std::string(seed_filename) + "' (length: " + std::to_string(strlen(seed_filename)) + ")");
-                            if (strcmp(seed_filename, filename) == 0) {
-                                file_found = true;
-                                log_client("  MATCH!");
-                                break;
-                            }
-                        }
-                        line = strtok(NULL, "\n");
-                    }
-                    
-                    if (file_found) {
-                        log_client("FOUND!");
-                        std::cout << "found" << std::endl;
-                        available_seeds.push_back(port);
-                    } else {
-                        log_client("not found");
-                        std::cout << "not found" << std::endl;
-                    }
-                } else {
-                    log_client("no response from port " + std::to_string(port));
-                    std::cout << "no response" << std::endl;
-                }
-            } else {
-                log_client("port " + std::to_string(port) + " not running");
-                std::cout << "not running" << std::endl;
-            }
-            
-            close(sock);
-        }
+
+// Record finished chunks in the sidecar. The bitmap is copied before the
+// data is flushed, so every bit written refers to data already on disk; a
+// torn or lost sidecar write only ever loses progress, never invents it.
+void checkpoint_resume_map(parallel_ctx_t* ctx) {
+    if (ctx->map_fd < 0) {
+        return;
     }
     
-    log_client("Found " + std::to_string(available_seeds.size()) + " seed(s) with file '" + std::string(filename) + "'");
-    std::cout << "Found " << available_seeds.size() << " seed(s) with file '" << filename << "'" << std::endl;
-    
-    // Try to get file size from first available seed for progress tracking
-    if (!available_seeds.empty()) {
-        auto file_size = get_file_size_from_seed(available_seeds[0], filename);
-        if (file_size > 0) {
-            log_client("Estimated file size: " + std::to_string(file_size) + " bytes");
-        }
+    std::vector<uint64_t> words(ctx->done.word_count);
+    for (auto w = 0; w < ctx->done.word_count; w++) {
+        words[w] = ctx->done.words[w].load(std::memory_order_acquire);
+    }
+    if (fdatasync(ctx->file_fd) != 0) {
+        return;
     }
+    pwrite(ctx->map_fd, words.data(), words.size() * sizeof(uint64_t), sizeof(resume_map_header_t));
 }
 
-// New function to download file using round-robin chunk distribution
-void download_file_round_robin(const char* filename, const std::vector<int>& available_seeds) {
+// Download a task's file from every available seed at once.
+// Returns true once the file is complete and in place.
+bool parallel_download(download_thread_data_t* task) {
+    const char* filename = task->filename;
+    const std::vector<int>& available_seeds = *task->available_seeds;
     if (available_seeds.empty()) {
-        log_client("No seeds available for this file.");
+        LOG_CLIENT(LOG_INFO, "No seeds available for this file.");
         std::cout << "No seeds available for this file." << std::endl;
-        return;
+        return false;
     }
     
-    const int CHUNK_SIZE = 32;  // Fixed 32-byte chunks
-    auto total_seeds = available_seeds.size();
-    auto current_seed_index = 0;
+    auto total_seeds = (int)available_seeds.size();
     
     // Determine local folder structure
     auto my_folder_id = -1;
@@ -911,275 +4970,313 @@ void download_file_round_robin(const char* filename, const std::vector<int>& ava
     }
     
     if (my_folder_id == -1) {
-        log_client("Error: Could not determine local folder.");
+        LOG_CLIENT(LOG_ERROR, "Error: Could not determine local folder.");
         std::cout << "Error: Could not determine local folder." << std::endl;
-        return;
+        return false;
     }
     
-    // We'll determine the download directory after getting the first chunk
-    char download_dir[1024];
-    char download_path[1024];
-    FILE *output_file = nullptr;
-    int first_source_folder_id = -1;
-    
-    // Directory and file will be created after getting first chunk
+    // The file goes under the folder of the first seed that has it
+    auto first_source_folder_id = -1;
+    for (auto i = 0; i < MAX_PORTS; i++) {
+        if (PORTS[i] == available_seeds[0]) {
+            first_source_folder_id = i + 1;
+            break;
+        }
+    }
+    if (first_source_folder_id == -1) {
+        LOG_CLIENT(LOG_ERROR, "Error: Could not determine folder ID for port " + std::to_string(available_seeds[0]));
+        return false;
+    }
     
-    log_client("Starting round-robin download from " + std::to_string(total_seeds) + " seed(s)...");
-    log_client("Downloading in " + std::to_string(CHUNK_SIZE) + "-byte chunks...");
+    // Every chunk is placed by offset, so the exact size is needed up front
+    auto file_size = task->expected_size >= 0 ? task->expected_size : get_file_size_from_seed(available_seeds[0], filename);
+    if (file_size < 0) {
+        LOG_CLIENT(LOG_WARN, "Download failed - could not determine file size.");
+        return false;
+    }
     
-    // Initialize progress tracking
-    auto total_bytes_downloaded = 0LL;
-    auto chunk_count = 0;
-    auto estimated_total_size = get_file_size_from_seed(available_seeds[0], filename);
+    char download_dir[1024];
+    char download_path[1024];
+    char part_path[1100];
+    snprintf(download_dir, sizeof(download_dir), "files/seed%d/%d/%d", 
+             my_folder_id, my_folder_id, first_source_folder_id);
     
-    // Update global progress tracking
-    pthread_mutex_lock(&download_thread_mutex);
-    if (active_download.is_active) {
-        active_download.total_size = estimated_total_size;
-        active_download.total_chunks = (estimated_total_size + CHUNK_SIZE - 1) / CHUNK_SIZE; // Round up
+    LOG_CLIENT(LOG_DEBUG, "Creating directory: " + std::string(download_dir));
+    if (create_directory(download_dir) != 0) {
+        LOG_CLIENT(LOG_WARN, "Warning: Could not create directory " + std::string(download_dir));
     }
-    pthread_mutex_unlock(&download_thread_mutex);
     
-    if (estimated_total_size <= 0) {
-        estimated_total_size = CHUNK_SIZE * 100; // Fallback estimate
-        log_client("Using fallback file size estimate: " + std::to_string(estimated_total_size) + " bytes");
+    // Full path for the downloaded file
+    auto path_result = snprintf(download_path, sizeof(download_path), "%s/%s", download_dir, filename);
+    
+    // Check if the path was truncated
+    if (path_result >= (int)sizeof(download_path)) {
+        LOG_CLIENT(LOG_ERROR, "Error: File path too long, cannot download.");
+        return false;
     }
     
-    // Initialize progress tracking (silent background mode)
-    log_client("Download Progress: Starting at 0/" + std::to_string(estimated_total_size) + " bytes");
+    parallel_ctx_t ctx;
+    ctx.filename = filename;
+    ctx.seeds = available_seeds;
+    ctx.seed_count = total_seeds;
+    ctx.file_fd = -1;
+    ctx.map_fd = -1;
+    ctx.file_size = file_size;
+    ctx.chunk_size = DOWNLOAD_CHUNK_SIZE;
+    ctx.total_chunks = (file_size + ctx.chunk_size - 1) / ctx.chunk_size;
+    ctx.completed_chunks.store(0);
+    ctx.downloaded_bytes.store(0);
+    ctx.write_failed.store(false);
+    ctx.active_workers.store(0);
+    ctx.endgame.store(false);
+    ctx.wasted_bytes.store(0);
+    ctx.work_epoch.store(0);
+    pthread_mutex_init(&ctx.inflight_mutex, NULL);
+    pthread_cond_init(&ctx.work_changed, NULL);
+    bitmap_init(&ctx.claimed, ctx.total_chunks);
+    bitmap_init(&ctx.done, ctx.total_chunks);
+    bitmap_init(&ctx.duplicated, ctx.total_chunks);
     
-    // Track which seeds have finished and their chunk counts
-    std::vector<bool> seed_finished(total_seeds, false);
-    std::vector<int> chunks_per_seed(total_seeds, 0);
-    int active_seed_count = total_seeds;
+    // Chunks are written into <name>.part, which is renamed once complete.
+    // <name>.part.map records which chunks are safely on disk, so an
+    // interrupted download picks up where it stopped.
+    char map_path[1110];
+    snprintf(part_path, sizeof(part_path), "%s.part", download_path);
+    snprintf(map_path, sizeof(map_path), "%s.part.map", download_path);
+    ctx.map_fd = open(map_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (ctx.map_fd < 0) {
+        LOG_CLIENT(LOG_WARN, "Warning: Could not open " + std::string(map_path) + ", download will not be resumable: " + strerror(errno));
+    }
     
-    // Round-robin download loop - download one chunk at a time
-    while (total_bytes_downloaded < estimated_total_size && active_seed_count > 0) {
-        auto current_seed_port = available_seeds[current_seed_index];
-        
-        // Skip finished seeds
-        if (seed_finished[current_seed_index]) {
-            current_seed_index = (current_seed_index + 1) % total_seeds;
-            continue;
+    auto resumed = false;
+    ctx.file_fd = open(part_path, O_RDWR | O_CLOEXEC);
+    if (ctx.file_fd >= 0 && ctx.map_fd >= 0 && load_resume_map(&ctx)) {
+        resumed = true;
+    } else {
+        if (ctx.file_fd >= 0) {
+            close(ctx.file_fd);
         }
-        
-        // Connect to current seed
-        auto sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock < 0) {
-            log_client("Failed to create socket for seed at port " + std::to_string(current_seed_port));
-            current_seed_index = (current_seed_index + 1) % total_seeds;
-            continue;
+        ctx.file_fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (ctx.file_fd < 0) {
+        LOG_CLIENT(LOG_ERROR, "Failed to create output file: " + std::string(part_path));
+        if (ctx.map_fd >= 0) {
+            close(ctx.map_fd);
         }
-        
-        struct sockaddr_in addr;
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(current_seed_port);
-        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-        
-        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
-            log_client("Failed to connect to seed at port " + std::to_string(current_seed_port));
-            close(sock);
-            current_seed_index = (current_seed_index + 1) % total_seeds;
-            continue;
+        bitmap_free(&ctx.claimed);
+        bitmap_free(&ctx.done);
+        bitmap_free(&ctx.duplicated);
+        pthread_mutex_destroy(&ctx.inflight_mutex);
+        pthread_cond_destroy(&ctx.work_changed);
+        return false;
+    }
+    
+    // Preallocate so out-of-order pwrite()s never have to extend the file
+    if (!resumed && file_size > 0 && posix_fallocate(ctx.file_fd, 0, file_size) != 0 && ftruncate(ctx.file_fd, file_size) != 0) {
+        LOG_CLIENT(LOG_ERROR, "Failed to preallocate output file: " + std::string(strerror(errno)));
+        close(ctx.file_fd);
+        if (ctx.map_fd >= 0) {
+            close(ctx.map_fd);
         }
-        
-        // Send download request with current offset - use a delimiter that won't conflict with filename
-        char request[512];
-        snprintf(request, sizeof(request), "DOWNLOAD %s|%lld", filename, total_bytes_downloaded);
-        send(sock, request, strlen(request), 0);
-        
-        // Receive chunk data - read exactly CHUNK_SIZE bytes
-        char chunk_buffer[CHUNK_SIZE];
-        auto bytes_received = 0;
-        auto total_chunk_bytes = 0;
-        
-        // Read exactly CHUNK_SIZE bytes or until connection closes
-        while (total_chunk_bytes < CHUNK_SIZE) {
-            auto bytes = recv(sock, chunk_buffer + total_chunk_bytes, CHUNK_SIZE - total_chunk_bytes, 0);
-            if (bytes <= 0) {
-                break; // Connection closed or error
+        remove(part_path);
+        remove(map_path);
+        bitmap_free(&ctx.claimed);
+        bitmap_free(&ctx.done);
+        bitmap_free(&ctx.duplicated);
+        pthread_mutex_destroy(&ctx.inflight_mutex);
+        pthread_cond_destroy(&ctx.work_changed);
+        return false;
+    }
+    if (!resumed && ctx.map_fd >= 0 && !create_resume_map(&ctx)) {
+        LOG_CLIENT(LOG_WARN, "Warning: Could not write " + std::string(map_path) + ", download will not be resumable");
+        close(ctx.map_fd);
+        ctx.map_fd = -1;
+        remove(map_path);
+    }
+    
+    // Count what an earlier attempt already finished
+    long long resumed_bytes = 0;
+    auto resumed_chunks = 0;
+    if (resumed) {
+        for (auto i = 0; i < ctx.total_chunks; i++) {
+            if (bitmap_test(&ctx.done, i)) {
+                resumed_chunks++;
+                auto chunk_end = (long long)(i + 1) * ctx.chunk_size;
+                resumed_bytes += (chunk_end > file_size ? file_size : chunk_end) - (long long)i * ctx.chunk_size;
             }
-            total_chunk_bytes += bytes;
         }
+        ctx.completed_chunks.store(resumed_chunks);
+        ctx.downloaded_bytes.store(resumed_bytes);
+        LOG_CLIENT(LOG_INFO, "Resuming '" + std::string(filename) + "': " + std::to_string(resumed_chunks) + "/" + std::to_string(ctx.total_chunks) + " chunks (" + format_file_size(resumed_bytes) + ") already on disk");
+    }
+    
+    auto file_fd = ctx.file_fd;
+    ctx.workers = new seed_worker_state_t[total_seeds];
+    
+    // Contiguous shares sized by each seed's score; stealing evens out the rest
+    auto weights = seed_weights(available_seeds);
+    auto weight_total = 0.0;
+    for (auto i = 0; i < total_seeds; i++) {
+        weight_total += weights[i];
+    }
+    auto weight_before = 0.0;
+    for (auto i = 0; i < total_seeds; i++) {
+        uint32_t begin = (uint32_t)(ctx.total_chunks * weight_before / weight_total);
+        weight_before += weights[i];
+        uint32_t end = i == total_seeds - 1 ? ctx.total_chunks : (uint32_t)(ctx.total_chunks * weight_before / weight_total);
+        auto& state = ctx.workers[i];
+        state.port = available_seeds[i];
+        state.range.store(pack_range(begin, end));
+        state.failed.store(false);
+        state.finished.store(false);
+        state.chunks.store(0);
+        state.pieces.store(0);
+        state.steals.store(0);
+        state.piece_size.store(download_initial_piece_size);
+        state.bandwidth.store(0);
+        state.rtt = 0;
         
-        bytes_received = total_chunk_bytes;
-        
-        if (bytes_received > 0) {
-            // Check for error message
-                    if (strncmp(chunk_buffer, "ERROR:", 6) == 0) {
-            // Don't spam error messages - this is normal when file is complete
-            if (total_bytes_downloaded < estimated_total_size) {
-                log_client("Seed error from port " + std::to_string(current_seed_port) + ": " + std::string(chunk_buffer, bytes_received));
-            }
-            close(sock);
-            current_seed_index = (current_seed_index + 1) % total_seeds;
-            
-            // Track consecutive errors
-            static int consecutive_errors = 0;
-            consecutive_errors++;
-            if (consecutive_errors >= total_seeds * 2) {
-                log_client("Too many consecutive errors. Download may be complete.");
-                break;
-            }
-            continue;
+        // Start the piece sizing from what this seed did last time
+        seed_score_t history;
+        if (get_seed_score(state.port, &history) && history.samples > 0) {
+            state.bandwidth.store((long long)history.throughput);
+            state.rtt = history.latency;
         }
-            
-            // If this is the first chunk, determine folder structure and create file
-            if (chunk_count == 0) {
-                // Map port to folder ID
-                for (auto i = 0; i < MAX_PORTS; i++) {
-                    if (PORTS[i] == current_seed_port) {
-                        first_source_folder_id = i + 1;
-                        break;
-                    }
-                }
-                
-                if (first_source_folder_id == -1) {
-                    log_client("Error: Could not determine folder ID for port " + std::to_string(current_seed_port));
-                    close(sock);
-                    return;
-                }
-                
-                // Create download directory based on first successful seed
-                snprintf(download_dir, sizeof(download_dir), "files/seed%d/%d/%d", 
-                         my_folder_id, my_folder_id, first_source_folder_id);
-                
-                log_client("Creating directory: " + std::string(download_dir));
-                if (create_directory(download_dir) != 0) {
-                    log_client("Warning: Could not create directory " + std::string(download_dir));
-                }
-                
-                // Full path for the downloaded file
-                auto path_result = snprintf(download_path, sizeof(download_path), "%s/%s", download_dir, filename);
-                
-                // Check if the path was truncated
-                if (path_result >= sizeof(download_path)) {
-                    log_client("Error: File path too long, cannot download.");
-                    close(sock);
-                    return;
-                }
-                
-                // Create output file
-                output_file = fopen(download_path, "wb");
-                if (!output_file) {
-                    log_client("Failed to create output file: " + std::string(download_path));
-                    close(sock);
-                    return;
-                }
-                
-                log_client("First chunk from seed at port " + std::to_string(current_seed_port) + " (folder ID " + std::to_string(first_source_folder_id) + ")");
-            }
-            
-            // Write chunk to file
-            fwrite(chunk_buffer, 1, bytes_received, output_file);
-            total_bytes_downloaded += bytes_received;
-            chunk_count++;
-            
-            // Update global progress tracking
-            pthread_mutex_lock(&download_thread_mutex);
-            if (active_download.is_active) {
-                active_download.downloaded_bytes = total_bytes_downloaded;
-                active_download.completed_chunks = chunk_count;
-            }
-            pthread_mutex_unlock(&download_thread_mutex);
-            
-            // Reset consecutive failures since we got data
-            static int consecutive_failures = 0;
-            consecutive_failures = 0;
-            
-            // Check if we've reached end of file (less than full chunk received)
-            if (bytes_received < CHUNK_SIZE) {
-                chunks_per_seed[current_seed_index]++; // Count the final partial chunk too
-                log_client("Port " + std::to_string(current_seed_port) + " finished sending data (sent " + std::to_string(bytes_received) + " bytes in final chunk) [Total chunks from this seed: " + std::to_string(chunks_per_seed[current_seed_index]) + "]");
-                seed_finished[current_seed_index] = true;
-                active_seed_count--;
-                
-                if (active_seed_count == 0 || total_bytes_downloaded >= estimated_total_size) {
-                    log_client("End of file detected. Final size: " + std::to_string(total_bytes_downloaded) + " bytes");
-                    break;
-                }
-            } else {
-                // Full chunk received, increment counter and show progress
-                chunks_per_seed[current_seed_index]++;
-                log_client("Port " + std::to_string(current_seed_port) + " sent 32-byte chunk (" + std::to_string(chunk_count) + ") [Total from this seed: " + std::to_string(chunks_per_seed[current_seed_index]) + "]");
-            }
-            
-            // Also break if we've downloaded more than expected
-            if (total_bytes_downloaded >= estimated_total_size) {
-                log_client("Download completed. Final size: " + std::to_string(total_bytes_downloaded) + " bytes");
-                break;
-            }
-            
-            // Safety check: if we've downloaded way more than expected, stop
-            if (chunk_count > 10000) { // Prevent infinite loops
-                log_client("Safety limit reached. Stopping download at " + std::to_string(total_bytes_downloaded) + " bytes");
-                break;
-            }
-            
+        LOG_CLIENT(LOG_DEBUG, "Port " + std::to_string(state.port) + " starts with " + std::to_string(end - begin) + " chunks (weight " + std::to_string((int)(weights[i] * 100 / weight_total)) + "%)");
+        state.duplicates_sent.store(0);
+        state.duplicates_won.store(0);
+        state.session_fd = -1;
+        state.cancelled = false;
+    }
+    
+    // Publish the transfer so the status screen can follow it
+    pthread_mutex_lock(&download_thread_mutex);
+    task->total_size = file_size;
+    task->total_chunks = ctx.total_chunks;
+    task->transfer = &ctx;
+    pthread_mutex_unlock(&download_thread_mutex);
+    
+    LOG_CLIENT(LOG_INFO, "Starting parallel download of '" + std::string(filename) + "' from " + std::to_string(total_seeds) + " seed(s)...");
+    LOG_CLIENT(LOG_INFO, "Downloading " + std::to_string(file_size) + " bytes in " + std::to_string(ctx.total_chunks) + " chunks of " + std::to_string(ctx.chunk_size) + " bytes, up to " + std::to_string(SESSION_PIPELINE_DEPTH) + " pieces in flight per seed...");
+    LOG_CLIENT(LOG_INFO, "Piece size starts at " + format_file_size(download_initial_piece_size) + " and adapts per seed between " + format_file_size(download_min_piece_size) + " and " + format_file_size(download_max_piece_size));
+    LOG_CLIENT(LOG_INFO, "Download Progress: Starting at " + std::to_string(resumed_bytes) + "/" + std::to_string(file_size) + " bytes");
+    
+    // Launch one thread per seed
+    std::vector<pthread_t> tids(total_seeds);
+    std::vector<bool> started(total_seeds, false);
+    for (auto i = 0; i < total_seeds; i++) {
+        auto worker = new worker_arg_t;
+        worker->ctx = &ctx;
+        worker->seed_index = i;
+        ctx.active_workers++;
+        if (pthread_create(&tids[i], NULL, parallel_download_worker, worker) != 0) {
+            LOG_CLIENT(LOG_ERROR, "Error: Failed to start worker for port " + std::to_string(available_seeds[i]));
+            ctx.workers[i].failed.store(true);
+            ctx.workers[i].finished.store(true);
+            ctx.active_workers--;
+            delete worker;
         } else {
-            log_client("Port " + std::to_string(current_seed_port) + " has no more data to send");
-            seed_finished[current_seed_index] = true;
-            active_seed_count--;
-            
-            close(sock);
-            current_seed_index = (current_seed_index + 1) % total_seeds;
-            
-            // If all seeds are finished, we're done
-            if (active_seed_count == 0) {
-                log_client("All seeds have finished sending data. Download complete.");
-                break;
-            }
-            continue;
+            started[i] = true;
+        }
+    }
+    
+    // Checkpoint the sidecar while the workers run
+    auto last_checkpoint = monotonic_seconds();
+    while (ctx.active_workers.load() > 0) {
+        usleep(100000);
+        if (monotonic_seconds() - last_checkpoint >= CHECKPOINT_INTERVAL_SECONDS) {
+            checkpoint_resume_map(&ctx);
+            last_checkpoint = monotonic_seconds();
+        }
+    }
+    
+    // Join threads
+    for (auto i = 0; i < total_seeds; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
         }
-        
-        close(sock);
-        
-        // Move to next seed in round-robin fashion
-        current_seed_index = (current_seed_index + 1) % total_seeds;
-        
-        // Add delay between chunks for better progress monitoring
-        // This simulates realistic network conditions and allows for status updates
-        usleep(CHUNK_DELAY_MICROSECONDS);
     }
     
-    if (output_file) {
-        fclose(output_file);
+    auto completed = ctx.completed_chunks.load();
+    auto total_bytes_downloaded = ctx.downloaded_bytes.load();
+    
+    pthread_mutex_lock(&download_thread_mutex);
+    task->transfer = NULL;
+    task->downloaded_bytes = total_bytes_downloaded;
+    task->completed_chunks = completed;
+    pthread_mutex_unlock(&download_thread_mutex);
+    auto success = completed == ctx.total_chunks && !ctx.write_failed.load();
+    
+    if (success && (fsync(file_fd) != 0 || rename(part_path, download_path) != 0)) {
+        LOG_CLIENT(LOG_ERROR, "Error: Could not finalize " + std::string(download_path) + ": " + strerror(errno));
+        success = false;
+    }
+    if (success) {
+        remove(map_path);
+    } else {
+        checkpoint_resume_map(&ctx);
+    }
+    close(file_fd);
+    if (ctx.map_fd >= 0) {
+        close(ctx.map_fd);
     }
     
-    // Final download completion (silent background mode)
-    if (total_bytes_downloaded > 0) {
-        log_client("Download Progress: Completed at " + std::to_string(total_bytes_downloaded) + "/" + std::to_string(total_bytes_downloaded) + " bytes (100.0%)");
-        log_client("Round-robin download completed!");
-        log_client("Total bytes downloaded: " + std::to_string(total_bytes_downloaded));
-        log_client("Total chunks downloaded: " + std::to_string(chunk_count));
-        log_client("File saved to: " + std::string(download_path));
+    if (success) {
+        LOG_CLIENT(LOG_INFO, "Download Progress: Completed at " + std::to_string(total_bytes_downloaded) + "/" + std::to_string(file_size) + " bytes (100.0%)");
+        LOG_CLIENT(LOG_INFO, "Parallel download completed!");
+        LOG_CLIENT(LOG_INFO, "Total bytes downloaded: " + std::to_string(total_bytes_downloaded - resumed_bytes));
+        LOG_CLIENT(LOG_INFO, "Total chunks downloaded: " + std::to_string(completed - resumed_chunks));
+        if (resumed) {
+            LOG_CLIENT(LOG_INFO, "Resumed with " + std::to_string(resumed_bytes) + " bytes (" + std::to_string(resumed_chunks) + " chunks) from an earlier attempt");
+        }
+        LOG_CLIENT(LOG_INFO, "File saved to: " + std::string(download_path));
         
         // Show detailed chunk distribution
-        log_client("Chunk Distribution by Seed:");
+        LOG_CLIENT(LOG_INFO, "Chunk Distribution by Seed:");
         int total_chunks_check = 0;
-        for (size_t i = 0; i < total_seeds; i++) {
-            if (chunks_per_seed[i] > 0) {
+        for (auto i = 0; i < total_seeds; i++) {
+            auto chunks = ctx.workers[i].chunks.load();
+            if (chunks > 0) {
                 auto port = available_seeds[i];
-                auto percentage = (chunks_per_seed[i] * 100.0) / chunk_count;
-                std::stringstream ss;
-                ss << "  Port " << port << ": " << chunks_per_seed[i] << " chunks (" 
-                   << std::fixed << std::setprecision(1) << percentage << "%)";
-                log_client(ss.str());
-                total_chunks_check += chunks_per_seed[i];
+                auto fetched = completed - resumed_chunks;
+                auto percentage = fetched > 0 ? (chunks * 100.0) / fetched : 0.0;
+                LOG_CLIENT(LOG_INFO, "  Port " << port << ": " << chunks << " chunks ("
+                           << std::fixed << std::setprecision(1) << percentage << "%), "
+                           << ctx.workers[i].pieces.load() << " piece(s), "
+                           << ctx.workers[i].steals.load() << " steal(s), last piece size "
+                           << format_file_size(ctx.workers[i].piece_size.load()));
+                total_chunks_check += chunks;
             }
         }
-        log_client(" Verification: " + std::to_string(total_chunks_check) + "/" + std::to_string(chunk_count) + " chunks accounted for");
-        
-        // Close client logging after successful download
-        close_client_logging();
+        if (ctx.endgame.load()) {
+            auto duplicates_sent = 0;
+            auto duplicates_won = 0;
+            for (auto i = 0; i < total_seeds; i++) {
+                duplicates_sent += ctx.workers[i].duplicates_sent.load();
+                duplicates_won += ctx.workers[i].duplicates_won.load();
+            }
+            LOG_CLIENT(LOG_INFO, "Endgame: " + std::to_string(duplicates_sent) + " duplicate piece(s) requested, " + std::to_string(duplicates_won) + " won, " + format_file_size(ctx.wasted_bytes.load()) + " received twice");
+        }
+        LOG_CLIENT(LOG_INFO, " Verification: " + std::to_string(total_chunks_check) + "/" + std::to_string(completed - resumed_chunks) + " chunks accounted for");
     } else {
-        log_client("Download failed - no data received.");
-        std::cout << "\nDownload failed - no data received." << std::endl;
-        remove(download_path);
-        
-        // Close client logging after failed download
-        close_client_logging();
+        LOG_CLIENT(LOG_WARN, "Download failed - received " + std::to_string(completed) + "/" + std::to_string(ctx.total_chunks) + " chunks.");
+        std::cout << "\nDownload of '" << filename << "' failed." << std::endl;
+        if (ctx.map_fd >= 0 && !ctx.write_failed.load()) {
+            LOG_CLIENT(LOG_INFO, "Kept " + std::string(part_path) + " - the next attempt resumes from " + std::to_string(completed) + " chunks");
+        } else {
+            remove(part_path);
+            remove(map_path);
+        }
     }
+    LOG_CLIENT(LOG_INFO, "Connection pool: " + connection_pool_summary());
+    
+    bitmap_free(&ctx.claimed);
+    bitmap_free(&ctx.done);
+    bitmap_free(&ctx.duplicated);
+    pthread_mutex_destroy(&ctx.inflight_mutex);
+    pthread_cond_destroy(&ctx.work_changed);
+    delete[] ctx.workers;
+    return success;
 }
 
 // Progress bar function to show download progress
@@ -1259,156 +5356,379 @@ bool check_file_already_exists(const char* filename, long long expected_size, ch
 
 // Function to get file size from a specific seed using FILESIZE command
 long long get_file_size_from_seed(int port, const char* filename) {
-    auto sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        return -1;
-    }
-    
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    // Send FILESIZE request to get exact file size
+    char request[512];
+    snprintf(request, sizeof(request), "FILESIZE %s", filename);
     
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
-        close(sock);
+    bool ok = false;
+    bool binary = false;
+    std::string response;
+    auto result = seed_wire_call(port, WIRE_OP_FILESIZE, filename, request, &ok, &binary, response);
+    if (result == SEED_NOT_RUNNING) {
         return -1;
     }
     
-    // Send FILESIZE request to get exact file size
-    char request[512];
-    snprintf(request, sizeof(request), "FILESIZE %s", filename);
-    send(sock, request, strlen(request), 0);
+    if (result == SEED_CALL_OK && ok) {
+        if (binary && response.size() == sizeof(uint64_t)) {
+            uint64_t size;
+            memcpy(&size, response.data(), sizeof(size));
+            LOG_CLIENT(LOG_DEBUG, "Exact file size from seed: " + std::to_string(le64toh(size)) + " bytes");
+            return (long long)le64toh(size);
+        }
+        if (!binary && strncmp(response.c_str(), "SIZE:", 5) == 0) {
+            long long file_size = atoll(response.c_str() + 5);
+            LOG_CLIENT(LOG_DEBUG, "Exact file size from seed: " + std::to_string(file_size) + " bytes");
+            return file_size;
+        }
+    }
     
-    // Read the file size response
-    char buffer[64];
-    auto bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    LOG_CLIENT(LOG_WARN, "Could not determine file size from seed at port " + std::to_string(port));
+    return -1;
+}
+
+// Split one line of a seed's listing. LISTX lines carry
+// "name\tsize\tmtime\tdigest"; plain LIST lines are "[n] name" and leave
+// size -1, mtime 0 and digest empty. Returns false for anything else.
+bool parse_listing_line(char* line, listing_entry_t* entry) {
+    entry->size = -1;
+    entry->mtime = 0;
+    entry->digest.clear();
     
-    close(sock);
+    auto tab = strchr(line, '\t');
+    if (tab == NULL) {
+        auto bracket_end = strchr(line, ']');
+        if (line[0] != '[' || bracket_end == NULL || bracket_end[1] != ' ') {
+            return false;
+        }
+        entry->filename = bracket_end + 2;
+        return true;
+    }
     
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
-        if (strncmp(buffer, "SIZE:", 5) == 0) {
-            long long file_size = atoll(buffer + 5);
-            log_client("Exact file size from seed: " + std::to_string(file_size) + " bytes");
-            return file_size;
+    entry->filename.assign(line, tab - line);
+    char* end = NULL;
+    entry->size = strtoll(tab + 1, &end, 10);
+    if (*end != '\t') {
+        return false;
+    }
+    entry->mtime = (time_t)strtoll(end + 1, &end, 10);
+    if (*end == '\t' && strcmp(end + 1, "-") != 0) {
+        entry->digest = end + 1;
+    }
+    return true;
+}
+
+// Hand every file on one listing page to the scan's callback
+void parse_listing_page(int port, char* page, listing_scan_t* scan) {
+    listing_entry_t listed;
+    char* saveptr = NULL;
+    auto line = strtok_r(page, "\n", &saveptr);
+    while (line != NULL) {
+        if (parse_listing_line(line, &listed)) {
+            scan->on_entry(port, &listed, scan->arg);
         }
+        line = strtok_r(NULL, "\n", &saveptr);
+    }
+}
+
+// scan_reply_fn for LISTX: consume one page and ask for the next one
+std::string next_listing_page(scan_result_t* result, void* arg) {
+    auto scan = (listing_scan_t*)arg;
+    auto& page = result->payload;
+    auto newline = page.find('\n');
+    if (newline == std::string::npos) {
+        page.clear();
+        return "";
     }
     
-    // Fallback: use a reasonable default for unknown files
-    log_client("Could not determine file size, using default estimate");
-    return 1024 * 1024; // 1MB default
+    std::string next;
+    if (page.compare(0, 5, "NEXT ") == 0) {
+        next = scan->command + " " + page.substr(5, newline - 5);
+    }
+    parse_listing_page(result->port, &page[newline + 1], scan);
+    page.clear();
+    return next;
 }
 
-// Port2Port File Discovery - connect to other running instances
-void listAvailableFiles() {
-    log_client("Searching for files...");
-    std::cout << "\nSearching for files... " << std::endl;
+// Ask every peer for its listing with LISTX, a page at a time, and fall
+// back to plain LIST for seeds that predate it (they answer LISTX with an
+// error). Files are handed to `on_entry` as pages arrive rather than
+// collected, so only one page per peer is held at once; `results` keeps
+// each peer's status with an empty payload.
+void scan_listings(std::vector<scan_result_t>& results, listing_entry_fn on_entry, void* arg) {
+    listing_scan_t scan;
+    scan.command = list_digests ? "LISTX DIGEST" : "LISTX";
+    scan.on_entry = on_entry;
+    scan.arg = arg;
+    scan_peers(scan.command.c_str(), results, NULL, next_listing_page, &scan);
     
-    // Reset file counter
-    pthread_mutex_lock(&file_list_mutex);
-    unique_file_count = 0;
-    pthread_mutex_unlock(&file_list_mutex);
+    std::vector<int> legacy_ports;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].result == SEED_CALL_OK && !results[i].ok) {
+            legacy_ports.push_back(results[i].port);
+        }
+    }
+    if (legacy_ports.empty()) {
+        return;
+    }
     
+    std::vector<scan_result_t> legacy_results;
+    scan_peers("LIST", legacy_results, &legacy_ports);
+    for (size_t i = 0; i < legacy_results.size(); i++) {
+        if (legacy_results[i].result == SEED_CALL_OK && legacy_results[i].ok) {
+            parse_listing_page(legacy_results[i].port, &legacy_results[i].payload[0], &scan);
+            legacy_results[i].payload.clear();
+        }
+        for (size_t j = 0; j < results.size(); j++) {
+            if (results[j].port == legacy_results[i].port) {
+                results[j] = legacy_results[i];
+            }
+        }
+    }
+}
+
+// listing_entry_fn for discovery: file each listed copy into the catalog
+void add_listed_file(int port, listing_entry_t* listed, void* arg) {
+    auto catalog = (catalog_t*)arg;
+    if (!catalog_add(catalog, listed->filename.c_str(), port, listed->size, listed->mtime, listed->digest)) {
+        LOG_CLIENT(LOG_WARN, "Port " + std::to_string(port) + " has a different copy of '" + listed->filename + "', not using it as a seed");
+    }
+}
+
+// Port2Port File Discovery - connect to other running instances
+// Ask every peer for its files and publish the result as the new catalog.
+// `verbose` prints per-port progress for the menu.
+std::shared_ptr<catalog_t> discover_files(bool verbose) {
+    // Build a fresh catalog; the previous one stays readable until it is replaced
+    auto catalog = catalog_create();
     auto seeds_found = 0;
     
-    // Try to connect to all other ports
-    for (auto i = 0; i < MAX_PORTS; i++) {
-        auto port = PORTS[i];
-        if (port != my_bound_port) {
-            log_client("Trying to connect to port " + std::to_string(port));
+    // Ask all other ports at once
+    std::vector<scan_result_t> results;
+    scan_listings(results, add_listed_file, catalog.get());
+    
+    for (size_t i = 0; i < results.size(); i++) {
+        auto port = results[i].port;
+        LOG_CLIENT(LOG_DEBUG, "Trying to connect to port " + std::to_string(port));
+        if (verbose) {
             std::cout << "Trying to connect to port " << port << " ";
-            
-            //this will create a socket for the port
-            auto sock = socket(AF_INET, SOCK_STREAM, 0);
-            if (sock < 0) {
-                log_client("socket failed for port " + std::to_string(port));
-                std::cout << "socket failed" << std::endl;
-                continue;
-            }
-            
-            struct sockaddr_in addr;
-            addr.sin_family = AF_INET;
-            addr.sin_port = htons(port);
-            inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
-            
-            if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-                send(sock, "LIST", strlen("LIST"), 0);
-                
-                char buffer[1024];
-                auto n = recv(sock, buffer, sizeof(buffer) - 1, 0);
-                if (n > 0) {
-                    buffer[n] = '\0';
-                    log_client("connected to port " + std::to_string(port) + ", found files");
+        }
+        
+        if (results[i].result != SEED_NOT_RUNNING) {
+            if (results[i].result == SEED_CALL_OK && results[i].ok) {
+                LOG_CLIENT(LOG_DEBUG, "connected to port " + std::to_string(port) + ", found files");
+                if (verbose) {
                     std::cout << "connected, found files" << std::endl;
-                    seeds_found++;
-                    
-                    // Parse response and add files
-                    auto line = strtok(buffer, "\n");
-                    while (line != NULL) {
-                        auto bracket_end = strchr(line, ']');
-                        if (bracket_end && bracket_end[1] == ' ') {
-                            add_unique_file(bracket_end + 2, port);
-                        }
-                        line = strtok(NULL, "\n");
-                    }
-                } else {
-                    log_client("no response from port " + std::to_string(port));
-                    std::cout << "no response" << std::endl;
                 }
+                seeds_found++;
             } else {
-                log_client("port " + std::to_string(port) + " not running");
+                LOG_CLIENT(LOG_DEBUG, "no response from port " + std::to_string(port));
+                if (verbose) {
+                    std::cout << "no response" << std::endl;
+                }
+            }
+        } else {
+            LOG_CLIENT(LOG_DEBUG, "port " + std::to_string(port) + " not running");
+            if (verbose) {
                 std::cout << "not running" << std::endl;
             }
-            
-            close(sock);
         }
     }
     
-    log_client("Search completed.");
+    // Sizes already learned for files only legacy seeds listed carry over
+    auto previous = current_catalog();
+    pthread_mutex_lock(&catalog->order_mutex);
+    std::vector<std::string> names = catalog->order;
+    pthread_mutex_unlock(&catalog->order_mutex);
+    catalog_entry_t listed, known;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (catalog_lookup(catalog.get(), names[i], &listed) && listed.size < 0 &&
+            catalog_lookup(previous.get(), names[i], &known) && known.size >= 0) {
+            catalog_set_size(catalog.get(), names[i], known.size);
+        }
+    }
+    
+    catalog->seeds_found = seeds_found;
+    publish_catalog(catalog);
+    return catalog;
+}
+
+void* catalog_refresh_thread(void* arg) {
+    (void)arg;
+    discover_files(false);
+    LOG_CLIENT(LOG_INFO, "Background catalog refresh completed");
+    catalog_refreshing.store(false);
+    return NULL;
+}
+
+// Rediscover in the background; at most one refresh runs at a time
+void refresh_catalog_async() {
+    if (catalog_refreshing.exchange(true)) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, catalog_refresh_thread, NULL) != 0) {
+        catalog_refreshing.store(false);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+void listAvailableFiles() {
+    LOG_CLIENT(LOG_INFO, "Searching for files...");
+    std::cout << "\nSearching for files... " << std::endl;
+    
+    auto catalog = discover_files(true);
+    auto seeds_found = catalog->seeds_found;
+    
+    LOG_CLIENT(LOG_INFO, "Search completed.");
     std::cout << "done." << std::endl;
     
     // Display results
-    pthread_mutex_lock(&file_list_mutex);
-    if (unique_file_count == 0) {
-        log_client("No files found from port instances. (No other instances appear to be running)");
+    auto file_count = catalog_count(catalog.get());
+    if (file_count == 0) {
+        LOG_CLIENT(LOG_INFO, "No files found from port instances. (No other instances appear to be running)");
         std::cout << "No files found from port instances." << std::endl;
         std::cout << "(No other instances appear to be running)" << std::endl;
     } else {
-        log_client("Files available. Found files from " + std::to_string(seeds_found) + " running port(s)");
+        LOG_CLIENT(LOG_INFO, "Files available. Found files from " + std::to_string(seeds_found) + " running port(s)");
         std::cout << "Files available." << std::endl;
-        for (auto i = 0; i < unique_file_count; i++) {
-            log_client("[" + std::to_string(i + 1) + "] " + std::string(unique_files[i].filename) + " (from port " + std::to_string(unique_files[i].source_port) + ")");
-            std::cout << "[" << i + 1 << "] " << 
-                unique_files[i].filename << " (from port " << unique_files[i].source_port << ")" << std::endl;
+        catalog_entry_t entry;
+        for (auto i = 1; i <= file_count; i++) {
+            if (catalog_entry_at(catalog.get(), i, &entry)) {
+                LOG_CLIENT(LOG_INFO, "[" + std::to_string(i) + "] " + format_catalog_entry(entry));
+                std::cout << "[" << i << "] " << format_catalog_entry(entry) << std::endl;
+            }
         }
         std::cout << "\n(Found files from " << seeds_found << " running port(s))" << std::endl;
     }
-    pthread_mutex_unlock(&file_list_mutex);
 }
 
 void show_download_status() {
     std::cout << "\nDownload status:" << std::endl;
     
+    const char* state_names[] = {"queued", "downloading", "done", "failed"};
+    
     pthread_mutex_lock(&download_thread_mutex);
-    if (active_download.is_active) {
+    if (download_tasks.empty()) {
+        std::cout << "No active downloads." << std::endl;
+    }
+    for (size_t t = 0; t < download_tasks.size(); t++) {
+        auto task = download_tasks[t];
+        auto ctx = task->transfer;
+        auto downloaded = ctx != NULL ? ctx->downloaded_bytes.load() : task->downloaded_bytes;
+        
         // Calculate percentage
         double percentage = 0.0;
-        if (active_download.total_size > 0) {
-            percentage = (double)active_download.downloaded_bytes / active_download.total_size * 100.0;
+        if (task->total_size > 0) {
+            percentage = (double)downloaded / task->total_size * 100.0;
         }
         
         // Format sizes
-        std::string downloaded_str = format_file_size(active_download.downloaded_bytes);
-        std::string total_str = format_file_size(active_download.total_size);
+        std::string downloaded_str = format_file_size(downloaded);
+        std::string total_str = format_file_size(task->total_size);
         
         // Display progress
-        std::cout << "[1] " << active_download.filename << "  " 
+        std::cout << "[" << task->id << "] " << task->filename << "  " 
                   << downloaded_str << "/" << total_str 
-                  << " (" << std::fixed << std::setprecision(2) << percentage << "%)" << std::endl;
-    } else {
-        std::cout << "No active downloads." << std::endl;
+                  << " (" << std::fixed << std::setprecision(2) << percentage << "%)  "
+                  << state_names[task->state];
+        if (task->priority != 0) {
+            std::cout << ", priority " << task->priority;
+        }
+        std::cout << std::endl;
+        
+        // Per-seed piece size and measured bandwidth
+        if (ctx != NULL) {
+            for (auto i = 0; i < ctx->seed_count; i++) {
+                auto& state = ctx->workers[i];
+                std::cout << "    Port " << state.port << ": piece size " << format_file_size(state.piece_size.load())
+                          << ", " << format_file_size(state.bandwidth.load()) << "/s, "
+                          << state.chunks.load() << " chunks"
+                          << (state.failed.load() ? " (failed)" : "") << std::endl;
+            }
+        }
+    }
+    std::cout << "Running " << running_downloads << "/" << max_concurrent_downloads
+              << ", " << download_queue.size() << " queued";
+    if (bandwidth_limit > 0) {
+        std::cout << ", bandwidth limit " << format_file_size(bandwidth_limit) << "/s";
     }
+    std::cout << std::endl;
     pthread_mutex_unlock(&download_thread_mutex);
+    
+    show_seed_scores();
+    std::cout << "Connection pool: " << connection_pool_summary() << std::endl;
+    std::cout << "Serving file cache: " << fd_cache_summary() << std::endl;
+    std::cout << "Seed server: " << server_summary() << std::endl;
+    show_acceptor_stats();
+}
+
+// Read a byte count from the environment, keeping the default when unset,
+// malformed or below `min_value`
+long long config_value(const char* name, long long default_value, long long min_value = 1) {
+    auto value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return default_value;
+    }
+    char* end = NULL;
+    auto parsed = strtoll(value, &end, 10);
+    if (*end != '\0' || parsed < min_value) {
+        std::cout << "Ignoring invalid " << name << "=" << value << std::endl;
+        return default_value;
+    }
+    return parsed;
+}
+
+// Read an on/off switch from the environment: 1 turns it on, 0 off
+bool config_flag(const char* name, bool default_value) {
+    auto value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return default_value;
+    }
+    if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0) {
+        std::cout << "Ignoring invalid " << name << "=" << value << std::endl;
+        return default_value;
+    }
+    return *value == '1';
+}
+
+void load_download_config() {
+    download_min_piece_size = config_value("SEEDAPP_MIN_PIECE", download_min_piece_size);
+    download_max_piece_size = config_value("SEEDAPP_MAX_PIECE", download_max_piece_size);
+    download_initial_piece_size = config_value("SEEDAPP_INITIAL_PIECE", download_initial_piece_size);
+    
+    // Pieces are whole chunks, and the bounds have to make sense together
+    if (download_min_piece_size < DOWNLOAD_CHUNK_SIZE) {
+        download_min_piece_size = DOWNLOAD_CHUNK_SIZE;
+    }
+    if (download_max_piece_size < download_min_piece_size) {
+        download_max_piece_size = download_min_piece_size;
+    }
+    if (download_initial_piece_size < download_min_piece_size) {
+        download_initial_piece_size = download_min_piece_size;
+    }
+    if (download_initial_piece_size > download_max_piece_size) {
+        download_initial_piece_size = download_max_piece_size;
+    }
+    download_min_piece_size -= download_min_piece_size % DOWNLOAD_CHUNK_SIZE;
+    download_max_piece_size -= download_max_piece_size % DOWNLOAD_CHUNK_SIZE;
+    download_initial_piece_size -= download_initial_piece_size % DOWNLOAD_CHUNK_SIZE;
+    
+    max_concurrent_downloads = (int)config_value("SEEDAPP_MAX_DOWNLOADS", max_concurrent_downloads);
+    scan_timeout_ms = config_value("SEEDAPP_SCAN_TIMEOUT_MS", scan_timeout_ms);
+    fd_cache_capacity = config_value("SEEDAPP_FD_CACHE", fd_cache_capacity);
+    serve_mmap = config_flag("SEEDAPP_SERVE_MMAP", serve_mmap);
+    server_threads = config_value("SEEDAPP_SERVER_THREADS", server_threads);
+    accept_queue_depth = config_value("SEEDAPP_ACCEPT_QUEUE", accept_queue_depth);
+    max_connections = config_value("SEEDAPP_MAX_CONNECTIONS", max_connections);
+    acceptor_count = config_value("SEEDAPP_ACCEPTORS", acceptor_count);
+    listen_backlog = config_value("SEEDAPP_LISTEN_BACKLOG", listen_backlog);
+    mmap_budget = config_value("SEEDAPP_MMAP_BUDGET", mmap_budget);
+    list_digests = config_flag("SEEDAPP_LIST_DIGEST", list_digests);
+    wire_protocol = !config_flag("SEEDAPP_TEXT_PROTOCOL", !wire_protocol);
+    log_level = config_value("SEEDAPP_LOG_LEVEL", log_level);
+    catalog_ttl_seconds = config_value("SEEDAPP_CATALOG_TTL", catalog_ttl_seconds, 0);
+    bandwidth_limit = config_value("SEEDAPP_BANDWIDTH_LIMIT", bandwidth_limit, 0);
 }
 
 void show_menu() {
@@ -1418,7 +5738,8 @@ void show_menu() {
         std::cout << "[1] List available files.\n";
         std::cout << "[2] Download file.\n";
         std::cout << "[3] Download status.\n";
-        std::cout << "[4] Exit.\n";
+        std::cout << "[4] Metrics.\n";
+        std::cout << "[5] Exit.\n";
         std::cout << "\n ? ";
 
         std::cin >> choice;
@@ -1435,26 +5756,24 @@ void show_menu() {
                 show_download_status();
                 break;
             case 4:
+                show_metrics();
+                break;
+            case 5:
                 std::cout << "Exiting..." << std::endl;
                 break;
             default:
                 std::cout << "Invalid choice. Please try again." << std::endl;
         }
-    } while (choice != 4);
+    } while (choice != 5);
 }
 
 int main() {
     bound_port_count = 0;
-    unique_file_count = 0;
     my_bound_port = -1;
+    file_catalog = catalog_create();
     
-    // Initialize download thread data
-    active_download.is_active = false;
-    active_download.available_seeds = nullptr;
-    active_download.total_size = 0;
-    active_download.downloaded_bytes = 0;
-    active_download.total_chunks = 0;
-    active_download.completed_chunks = 0;
+    load_download_config();
+    init_metrics();
     
     // Start single port server
     port_server();
@@ -1474,10 +5793,9 @@ int main() {
     // Close any active logging
     close_client_logging();
     close_server_logging();
+    stop_log_writer();
     
     pthread_mutex_destroy(&file_list_mutex);
-    pthread_mutex_destroy(&client_log_mutex);
-    pthread_mutex_destroy(&server_log_mutex);
     pthread_mutex_destroy(&download_thread_mutex);
     
     return 0;